@@ -0,0 +1,131 @@
+/**
+ * @file deque.c
+ * @author Alan R. Rogers
+ * @brief Chase-Lev work-stealing deque
+ *
+ * A fixed-capacity, lock-free double-ended queue of pointers. A
+ * single owner thread pushes and pops at the bottom. Any number of
+ * other threads may steal from the top. The algorithm is that of
+ * Chase and Lev (2005, SPAA), with the memory orderings given by Le,
+ * Pop, Cohen, and Zappa Nardelli (2013, PPoPP).
+ *
+ * The capacity is fixed when the deque is created. Deque_push
+ * returns false when the deque is full, and the caller must put the
+ * item somewhere else.
+ *
+ * @copyright Copyright (c) 2014, Alan R. Rogers
+ * <rogers@anthro.utah.edu>. This file is released under the Internet
+ * Systems Consortium License, which can be found in file "LICENSE".
+ */
+
+#include "deque.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#undef CHECKMEM
+#define   CHECKMEM(x) do {                                  \
+        if(!(x)) {                                          \
+            fprintf(stderr, "%s:%s:%d: allocation error\n", \
+                    __FILE__,__func__,__LINE__);            \
+            exit(EXIT_FAILURE);                             \
+        }                                                   \
+    } while(0);
+
+struct Deque {
+    long top;                   // next item to steal
+    char pad[64 - sizeof(long)];    // keep top and bottom on separate lines
+    long bottom;                // next free slot
+    long mask;                  // capacity - 1
+    void **buf;                 // circular buffer
+};
+
+/// Allocate a deque. Capacity is rounded up to a power of 2.
+Deque *Deque_new(long capacity) {
+    long n = 1;
+    while(n < capacity)
+        n <<= 1;
+
+    Deque *self = malloc(sizeof(Deque));
+    CHECKMEM(self);
+    self->top = self->bottom = 0;
+    self->mask = n - 1;
+    self->buf = malloc(n * sizeof(self->buf[0]));
+    CHECKMEM(self->buf);
+    return self;
+}
+
+void Deque_free(Deque * self) {
+    if(self == NULL)
+        return;
+    free(self->buf);
+    free(self);
+}
+
+/// Push onto the bottom. Owner only. Return false if full.
+bool Deque_push(Deque * self, void *item) {
+    long b = __atomic_load_n(&self->bottom, __ATOMIC_RELAXED);
+    long t = __atomic_load_n(&self->top, __ATOMIC_ACQUIRE);
+
+    if(b - t > self->mask)
+        return false;
+
+    __atomic_store_n(&self->buf[b & self->mask], item, __ATOMIC_RELAXED);
+    __atomic_store_n(&self->bottom, b + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/// Pop from the bottom. Owner only. Return NULL if empty.
+void *Deque_pop(Deque * self) {
+    long b = __atomic_load_n(&self->bottom, __ATOMIC_RELAXED) - 1;
+    void *item;
+
+    __atomic_store_n(&self->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long t = __atomic_load_n(&self->top, __ATOMIC_RELAXED);
+
+    if(t > b) {
+        // empty
+        __atomic_store_n(&self->bottom, b + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    item = __atomic_load_n(&self->buf[b & self->mask], __ATOMIC_RELAXED);
+    if(t == b) {
+        // last item: race against thieves
+        if(!__atomic_compare_exchange_n(&self->top, &t, t + 1, false,
+                                        __ATOMIC_SEQ_CST,
+                                        __ATOMIC_RELAXED))
+            item = NULL;
+        __atomic_store_n(&self->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+    return item;
+}
+
+/**
+ * Steal from the top. May be called by any thread. Return NULL if
+ * empty, or DEQUE_ABORT if another thread won a race for the top
+ * item.
+ */
+void *Deque_steal(Deque * self) {
+    long t = __atomic_load_n(&self->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long b = __atomic_load_n(&self->bottom, __ATOMIC_ACQUIRE);
+
+    if(t >= b)
+        return NULL;
+
+    void *item = __atomic_load_n(&self->buf[t & self->mask],
+                                 __ATOMIC_RELAXED);
+    if(!__atomic_compare_exchange_n(&self->top, &t, t + 1, false,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return DEQUE_ABORT;
+    return item;
+}
+
+/// Return true if the deque appeared empty at the moment of the call.
+bool Deque_empty(Deque * self) {
+    long t = __atomic_load_n(&self->top, __ATOMIC_ACQUIRE);
+    long b = __atomic_load_n(&self->bottom, __ATOMIC_ACQUIRE);
+    return t >= b;
+}
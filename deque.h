@@ -0,0 +1,27 @@
+/**
+ * @file deque.h
+ * @author Alan R. Rogers
+ * @brief Header for deque.c
+ * @copyright Copyright (c) 2014, Alan R. Rogers
+ * <rogers@anthro.utah.edu>. This file is released under the Internet
+ * Systems Consortium License, which can be found in file "LICENSE".
+ */
+
+#ifndef ARR_DEQUE
+#  define ARR_DEQUE
+
+#  include <stdbool.h>
+
+/// Returned by Deque_steal when it loses a race with another thread.
+/// The deque may still hold items, so the caller may try again.
+#  define DEQUE_ABORT ((void *) -1)
+
+typedef struct Deque Deque;
+
+Deque      *Deque_new(long capacity);
+void        Deque_free(Deque * self);
+bool        Deque_push(Deque * self, void *item);
+void       *Deque_pop(Deque * self);
+void       *Deque_steal(Deque * self);
+bool        Deque_empty(Deque * self);
+#endif
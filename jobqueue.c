@@ -15,18 +15,24 @@
  * Systems Consortium License, which can be found in file "LICENSE".
  */
 
+#define _GNU_SOURCE             // for CPU affinity
 #include "jobqueue.h"
+#include "deque.h"
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <pthread.h>
 #include <stdbool.h>
 #include <time.h>
-
-#undef DPRINTF_ON
-#include "dprintf.h"
-#ifdef DPRINTF_ON
-pthread_mutex_t outputLock = PTHREAD_MUTEX_INITIALIZER;
+#include <stdint.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#ifdef __linux__
+#  include <sys/eventfd.h>
 #endif
 
 #undef ERR
@@ -46,124 +52,3878 @@ pthread_mutex_t outputLock = PTHREAD_MUTEX_INITIALIZER;
         }                                                   \
     } while(0);
 
+#undef CHECKVALID
+#define CHECKVALID(jq) do {                                     \
+        if((jq)->valid != JOBQUEUE_VALID) {                     \
+            fprintf(stderr, "%s:%s:%d: JobQueue not initialized\n", \
+                    __FILE__,__func__,__LINE__);                \
+            exit(1);                                            \
+        }                                                       \
+    } while(0)
+
+/// Assumed size of a cache line, in bytes.
+#define JOBQUEUE_CACHE_LINE 64
+
+/// Start a member, and those that follow it, on a new cache line
+#define CACHE_ALIGNED __attribute__ ((aligned(JOBQUEUE_CACHE_LINE)))
+
+/// Default size of each thread's scratch arena, in bytes
+#define JOBQUEUE_ARENA_SIZE (64 * 1024L)
+
+/// Alignment of scratch allocations
+#define JOBQUEUE_ARENA_ALIGN 16
+
+/// Longest that a helping waiter sleeps before looking for work again
+#define JOBQUEUE_NAP_NS 100000L
+
+/// A worker in a shared pool keeps its slot for at least this long,
+/// in ns, before yielding it to a waiting queue.
+#define JOBQUEUE_SLICE_NS 1000000L
+
+/// Stride of a queue of weight 1, in stride scheduling
+#define JOBQUEUE_STRIDE1 (1L << 20)
+
+/// Events kept per worker in tracing mode; must be a power of 2
+#define JOBQUEUE_TRACE_EVENTS 4096
+
 typedef struct Job Job;
+typedef struct Worker Worker;
+typedef struct Slab Slab;
+typedef struct JobList JobList;
+typedef struct JobEdge JobEdge;
+typedef struct CallerState CallerState;
+typedef struct Arena Arena;
+typedef struct ArenaChunk ArenaChunk;
+
+/// A single job in the queue
+struct Job {
+    struct Job *next;           // next job in queue
+    void *param;                // data for current job
+    int (*jobfun) (void *param, void *tdat);    // function that does job
+    JobHandle *handle;          // completion handle, or NULL
+    JobGroup *group;            // group this job belongs to, or NULL
+    CancelToken *token;         // skip the job once cancelled, or NULL
+    int64_t enqueued;           // when queued (ns), or 0 if not recorded
+    int64_t deadline;           // soft deadline (ns), or 0 if none
+    int64_t expires;            // skip if not started by then (ns), or 0
+    short priority;             // 0 (lowest) to JOBQUEUE_NPRIORITY-1
+    bool moved;                 // param moved in; drop it if discarded
+    union {
+        int npred;              // predecessors that have not finished
+        int status;             // value of jobfun, once finished
+    };
+    union {
+        struct {
+            long lo, hi;        // iteration range, for parallelFor jobs
+        };
+        char data[JOBQUEUE_INLINE_BYTES];       // param, if copied in
+        struct {
+            char movedData[JOBQUEUE_MOVE_BYTES];
+            void (*drop) (void *param); // destroys a moved param
+        };
+    };
+} CACHE_ALIGNED;
+
+// Nodes fill two cache lines exactly, so that no two share a line.
+_Static_assert(sizeof(Job) == 2 * JOBQUEUE_CACHE_LINE,
+               "JOBQUEUE_INLINE_BYTES doesn't fill out the Job node");
+_Static_assert(offsetof(Job, data) % JOBQUEUE_INLINE_ALIGN == 0,
+               "inline parameters are misaligned");
+_Static_assert(offsetof(Job, drop) == offsetof(Job, data)
+               + JOBQUEUE_MOVE_BYTES, "JOBQUEUE_MOVE_BYTES is wrong");
+
+/// Link from a handle to a job that is waiting for it
+struct JobEdge {
+    JobEdge *next;
+    Job *job;
+};
+
+/**
+ * Completion handle for a single job. There are two references: one
+ * held by the caller until JobHandle_free, and one held by the job
+ * until it finishes. The handle is freed when both are gone.
+ */
+struct JobHandle {
+    JobQueue *jq;               // queue that runs the job
+    int refs;                   // reference count
+    bool done;                  // true once the job has finished
+    int status;                 // value returned by jobfun
+    JobEdge *then;              // jobs waiting for this one to finish
+    pthread_mutex_t lock;       // protects done, status, and then
+    pthread_cond_t finished;    // signalled when done becomes true
+};
+
+/**
+ * Cancellation token. References are held by the caller, until
+ * CancelToken_free, and by each job that carries the token.
+ */
+struct CancelToken {
+    int refs;                   // reference count
+    bool cancelled;             // set once, by CancelToken_cancel
+};
+
+/**
+ * Worker threads shared by several queues. The pool has nSlots
+ * slots, and each worker of a member queue holds one from launch
+ * until it exits, so the members never have more than nSlots threads
+ * in all. A member that needs a worker and finds no free slot waits
+ * for one. Meanwhile, idle workers of other members exit to make
+ * room, and busy ones exit after running for JOBQUEUE_SLICE_NS.
+ *
+ * A released slot goes to a waiting member by stride scheduling:
+ * each grant advances the receiving queue's pass by a stride that is
+ * inversely proportional to its weight, as does each further slice
+ * that a busy worker keeps its slot while others wait, and the
+ * waiting queue with the lowest pass goes next. Over time, queues
+ * that keep waiting receive slots in proportion to their weights.
+ */
+struct JobPool {
+    pthread_mutex_t lock;
+    int nSlots;                 // threads that members may have in all
+    int nFree;                  // slots held by no worker
+    int nWaiting;               // members waiting for a slot
+    long pass;                  // pass of the latest grant
+    JobQueue *members;          // list of member queues
+};
+
+/**
+ * A set of jobs that can be waited on apart from the rest of the
+ * queue. References are held by the caller, until JobGroup_free, and
+ * by each job that has not yet finished.
+ */
+struct JobGroup {
+    JobQueue *jq;               // queue that runs the jobs
+    int refs;                   // reference count
+    long outstanding;           // jobs added but not yet finished
+    long nErrors;               // number of jobs that returned nonzero
+    int firstError;             // status of first failure, or 0
+    pthread_mutex_t lock;       // used only for waiting
+    pthread_cond_t finished;    // signalled when outstanding reaches 0
+};
+
+/// A singly-linked list of jobs, with O(1) insertion at either end
+struct JobList {
+    Job *head;                  // next job to run
+    Job *tail;                  // last job in list
+    long len;                   // number of jobs in list
+};
+
+/// A block of Job nodes, allocated as a unit and freed with the
+/// JobQueue. The header is padded to a full cache line, so that the
+/// nodes that follow it are aligned too.
+struct Slab {
+    Slab *next;
+    char pad[JOBQUEUE_CACHE_LINE - sizeof(Slab *)];
+    Job jobs[];
+};
+
+/**
+ * Scratch memory for jobs. Allocation bumps an offset into a block
+ * that is allocated on first use. Requests that don't fit get chunks
+ * of their own from malloc. After each job, JobQueue_runJob rewinds
+ * the arena to where it was when the job started, and frees the
+ * chunks the job caused.
+ */
+struct Arena {
+    char *base;                 // block of size bytes, or NULL
+    size_t size;                // size of block
+    size_t used;                // bytes handed out
+    ArenaChunk *overflow;       // newest first
+};
+
+/// Overflow allocation from a scratch arena. The header is padded
+/// so that mem is aligned.
+struct ArenaChunk {
+    ArenaChunk *next;
+    char pad[JOBQUEUE_ARENA_ALIGN - sizeof(ArenaChunk *)];
+    char mem[];
+};
+
+/// Thread state for a thread outside the pool that runs jobs, either
+/// while it waits or because it submitted a job when the backlog was
+/// long. Kept on a list in the JobQueue, and reused.
+struct CallerState {
+    CallerState *next;
+    void *state;                // from ThreadState_new, or NULL
+    Arena arena;                // scratch memory
+};
+
+/**
+ * Counters kept by one worker. Only the owner writes them, using
+ * relaxed atomic stores, so JobQueue_getStats can read them at any
+ * time without locking. Each is aligned to a cache line, so that
+ * workers don't write to each other's lines.
+ */
+typedef struct WorkerStats {
+    long jobsRun;               // jobs executed (or discarded)
+    long jobsStolen;            // taken from another worker's deque
+    long parks;                 // waits on wakeWorker
+    int64_t idleNs;             // spinning or parked
+    int64_t lockNs;             // waiting for jq->lock
+    int64_t runNs;              // executing jobs
+    long waitHist[JOBQUEUE_HIST_BINS];  // time queued, log2 ns
+    long runHist[JOBQUEUE_HIST_BINS];   // time running, log2 ns
+} __attribute__ ((aligned(JOBQUEUE_CACHE_LINE))) WorkerStats;
+
+/// Add v to a counter owned by the current worker.
+#define STAT_ADD(x, v) \
+    __atomic_store_n(&(x), (x) + (v), __ATOMIC_RELAXED)
+
+/// Kinds of trace event
+enum {
+    TRACE_ENQUEUE,              // job added
+    TRACE_START,                // worker starts job
+    TRACE_FINISH,               // worker finishes job
+    TRACE_PARK,                 // worker sleeps on wakeWorker
+    TRACE_WAKE                  // worker wakes
+};
+
+typedef struct TraceEvent {
+    int64_t t;                  // when, from monotonicNs
+    const void *job;            // job node, or NULL
+    int type;                   // TRACE_ENQUEUE etc.
+} TraceEvent;
+
+/**
+ * Ring buffer holding the most recent JOBQUEUE_TRACE_EVENTS events.
+ * A worker's ring is written only by that worker. The last ring is
+ * shared by threads outside the pool, which claim slots with an
+ * atomic increment.
+ */
+typedef struct TraceRing {
+    unsigned long head;         // number of events ever recorded
+    TraceEvent ev[JOBQUEUE_TRACE_EVENTS];
+} __attribute__ ((aligned(JOBQUEUE_CACHE_LINE))) TraceRing;
+
+/// Record a trace event, if tracing is on.
+#define TRACE(jq, type, job) do {                               \
+        if(__atomic_load_n(&(jq)->tracing, __ATOMIC_ACQUIRE))   \
+            JobQueue_trace((jq), (type), (job));                \
+    } while(0)
+
+/// Data belonging to a single worker thread
+struct Worker {
+    JobQueue *jq;               // queue that owns this worker
+    int index;                  // position in jq->workers
+    Deque *deque;               // local jobs; used only in work-stealing mode
+    Job *cache;                 // free Job nodes, private to this worker
+    int ncached;                // number of nodes in cache
+    int64_t spinNs;             // current spin budget; adapts
+    WorkerStats *stats;         // in jq->stats
+    void *threadState;          // from ThreadState_new, while running
+    Arena arena;                // scratch memory, while running
+    int cpu;                    // pinned to this CPU, or -1
+    int node;                   // NUMA node of cpu, or -1
+    int state;                  // WORKER_FREE, _RESERVED, or _RUNNING
+    pthread_t thread;           // valid if launched
+    bool launched;              // thread has been created; must be joined
+    pthread_t prev;             // previous thread, if joinPrev
+    bool joinPrev;              // thread must join prev on starting
+    int64_t heldSince;          // when its slice of jq->pool began (ns)
+    JobList dealt;              // own jobs, in deterministic mode
+    pthread_cond_t wake;        // parks here, in deterministic mode
+    bool parked;                // waiting on wake
+} CACHE_ALIGNED;                // owners write it; don't share lines
+
+/// States of a worker slot
+enum {
+    WORKER_FREE,                // no thread, or one that has retired
+    WORKER_RESERVED,            // counted in nThreads; not yet created
+    WORKER_RUNNING              // thread created
+};
+
+/// All data used by job queue
+/**
+ * Fields are grouped by who writes them, and each group after the
+ * first begins a cache line of its own, so that writes to one group
+ * don't evict the lines that other threads are reading. The first
+ * group holds settings, which are read on every submit and pop but
+ * written seldom: before the workers start, or by the setters that
+ * may be called at any time. JobQueue_new aligns the structure.
+ */
+struct JobQueue {
+    int valid;                  // has JobQueue been initialized
+    bool acceptingJobs;         // false => don't wait for work
+    JobOrder order;             // LIFO or FIFO
+    bool workStealing;          // use per-worker deques
+    bool callerHelps;           // waitOnJobs runs queued jobs
+    bool deterministic;         // deal jobs to workers in turn
+    bool multiCore;             // more than one processor online
+    bool timing;                // record times in stats
+    bool tracing;               // record events in trace
+    int nSlots;                 // size of workers, stats, and trace
+    int maxThreads;             // maxumum number of threads; <= nSlots
+    int minThreads;             // idle timeout doesn't shrink pool below
+    int64_t idleNs;             // idle worker retires after; 0 => never
+    int64_t spinNs;             // max spin before parking; 0 => no spin
+    long inlineBacklog;         // addJob runs inline at this; 0 => never
+    JobPool *pool;              // shared worker threads, or NULL
+    size_t arenaSize;           // bytes in each thread's scratch arena
+    Worker *workers;            // array of nSlots workers
+    WorkerStats *stats;         // array of nSlots
+    TraceRing *trace;           // nSlots+1 rings, or NULL
+
+    // Bounded mode: a submitter that finds capacity jobs on the shared
+    // queue waits on wakeSubmitter until workers have brought the
+    // count down to lowWater.
+    long capacity;              // 0 => unbounded
+    long lowWater;              // resume submitting at this length
+
+    // Aging: a queued job gains one level of priority for each
+    // agingNs nanoseconds it waits. Queue times are recorded only
+    // once a job with nondefault priority or a deadline has been
+    // added. Jobs queued before then count as queued at agingEpoch.
+    int64_t agingNs;            // 0 => no aging
+    bool stampJobs;             // record queue times
+    int64_t agingEpoch;         // when stampJobs was set
+
+    // In cancel-on-error mode, the first failure discards queued
+    // jobs, and jobs are discarded rather than run until the errors
+    // are cleared.
+    bool cancelOnError;         // discard jobs after a failure
+    void (*onError) (void *errData, int status, void *param);
+    void *errData;              // passed to onError; not locally owned
+
+    // These items allow each thread to construct an object that
+    // persists for the life of the thread, is passed to each job
+    // processed by that thread, and is destroyed when the thread
+    // terminates. This allows the thread to maintain, for example, a
+    // random number generator, which is used sequentially by all
+    // tasks executed by that thread, but is only allocated and freed
+    // once.
+    void *threadData;           // constructor argument; not locally owned
+    void *(*ThreadState_new) (void *threadData);    // constuctor
+    void (*ThreadState_free) (void *threadState);   // destructor
+    pthread_attr_t attr;        // create joinable threads
+
+    // Inbox: an intrusive, lock-free, multi-producer queue in which
+    // submitters leave jobs of default priority without locking
+    // (Vyukov's MPSC algorithm). Whoever holds jq->lock moves them
+    // onto todo[0] before looking at the shared queue. A job joins
+    // nQueued once it is linked into the inbox. The head, which every
+    // submitter writes, has a line to itself.
+    Job *inHead CACHE_ALIGNED;  // last job pushed; written by submitters
+
+    // Written by submitters and by workers that take jobs, and polled
+    // by spinning workers.
+    long nQueued CACHE_ALIGNED; // number of jobs in shared queue
+
+    // Written by workers as they go idle and wake, and read by
+    // submitters deciding whether to wake anyone.
+    int idle CACHE_ALIGNED;     // number of idle threads
+    int spinning;               // idle threads spinning, not parked
+    int nThreads;               // current number of threads
+    int hiSlot;                 // 1 + highest slot ever reserved
+
+    // The shared queue and everything else under jq->lock
+    pthread_mutex_t lock CACHE_ALIGNED; // for locking queue
+    pthread_cond_t wakeWorker;  // for waking workers
+    pthread_cond_t wakeMain;    // for waking main
+    pthread_cond_t wakeSubmitter;   // for waking blocked submitters
+    JobList todo[JOBQUEUE_NPRIORITY];   // lists of jobs, one per priority
+    Job *inTail;                // next job to drain from the inbox
+    Job inStub;                 // dummy inbox node; never run
+    int nBlocked;               // submitters waiting for room
+    int nReady;                 // threads that have built their state
+    int nWaiting;               // workers in JobQueue_waitOnJobs
+    int nHelping;               // jobs run by others in JobQueue_help
+    int nextSlot;               // next worker dealt a job
+    long maxQueued;             // high-water mark of nQueued
+
+    // Jobs with deadlines are kept in a heap, ordered by deadline,
+    // apart from the lists above.
+    Job **heap;                 // binary heap of jobs with deadlines
+    long heapLen, heapCap;      // number of jobs, allocated size
+    long heapLenByPriority[JOBQUEUE_NPRIORITY];
+
+    // Jobs that return nonzero, or are discarded
+    long nErrors CACHE_ALIGNED; // number of failed jobs
+    int firstError;             // status of first failure, or 0
+    long nDiscarded;            // jobs discarded without running
+
+    // Pool of free Job nodes, shared by all threads. Workers keep
+    // their own caches and visit the pool only in batches.
+    pthread_mutex_t poolLock CACHE_ALIGNED; // for locking the pool
+    Job *freeJobs;              // list of free nodes
+    Slab *slabs;                // all memory allocated for nodes
+    CallerState *callers;       // free caller states
+
+    // Finished jobs, for JobQueue_completions. Workers push onto a
+    // lock-free stack; the single consumer takes it whole.
+    Job *doneHead CACHE_ALIGNED;        // newest first
+    Job *doneList;              // taken by the consumer, oldest first
+    bool notify;                // report finished jobs here
+    int notifyFd[2];            // read and write ends; may be equal
+
+    // Membership in a shared pool; guarded by pool->lock
+    JobQueue *poolNext CACHE_ALIGNED;   // next member of pool
+    long stride;                // JOBQUEUE_STRIDE1 / weight
+    long pass;                  // stride scheduling: lowest goes next
+    bool poolWaiting;           // waiting for a slot, to launch a worker
+    int poolGranted;            // slots granted to us, not yet taken
+    int poolPins;               // threads outside that may still use us
+    pthread_cond_t poolWake;    // signaled when poolPins falls to 0
+};
+
+#define JOBQUEUE_VALID 8131950
+
+/// Default interval for aging, in nanoseconds
+#define JOBQUEUE_AGING_NS 10000000L
+
+/// A job whose deadline is this close (ns), or past, runs first.
+#define JOBQUEUE_DEADLINE_SLACK_NS 1000000L
+
+/// Number of Job nodes allocated at a time.
+#define JOBQUEUE_SLAB_JOBS 256
+
+/// Number of nodes moved between a worker's cache and the shared
+/// pool at a time. A worker's cache holds at most twice this many.
+#define JOBQUEUE_CACHE_BATCH 64
+
+/// Capacity of each worker's deque in work-stealing mode. Jobs that
+/// don't fit go to the shared queue.
+#define JOBQUEUE_DEQUE_SIZE 1024
+
+/// Default limit on how long an idle worker spins before it parks
+#define JOBQUEUE_SPIN_NS 20000L
+
+/// After spinning, an idle worker yields this many times before it
+/// parks on the condition variable.
+#define JOBQUEUE_SPIN_YIELDS 8
+
+/// Spin iterations between reads of the clock
+#define JOBQUEUE_SPIN_CHECK 64
+
+#if defined(__x86_64__) || defined(__i386__)
+#  define CPU_RELAX() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#  define CPU_RELAX() __asm__ __volatile__("yield")
+#else
+#  define CPU_RELAX() do{}while(0)
+#endif
+
+/// Worker running in the current thread, or NULL if the current
+/// thread is not a worker.
+static __thread Worker *currWorker = NULL;
+
+/// Job running in the current thread, or NULL.
+static __thread Job *currJob = NULL;
+
+/// Scratch arena of the current thread, while it runs jobs
+static __thread Arena *currArena = NULL;
+
+/// In JobQueue_parallelFor with automatic grain size, aim for chunks
+/// that take about this many nanoseconds.
+#define JOBQUEUE_GRAIN_NS 50000.0
+
+/// How JobQueue_addJobMove puts a parameter into a job
+typedef struct JobMove {
+    void *src;                  // parameter to move from
+    void (*move) (void *dst, void *src);
+    void (*drop) (void *param);
+} JobMove;
+
+/// State shared by all jobs of a single call to JobQueue_parallelFor
+typedef struct ParFor {
+    JobQueue *jq;
+    int (*fn) (void *ctx, long lo, long hi, void *threadState);
+    void *ctx;
+    bool autoGrain;             // adjust grain from measured cost
+    long grain;                 // run ranges no larger than this
+    long maxGrain;              // upper bound on automatic grain
+    long remaining;             // iterations not yet finished
+    int status;                 // first nonzero return from fn
+    bool finished;              // true when remaining reaches 0
+    pthread_mutex_t lock;       // protects finished
+    pthread_cond_t done;        // signalled when finished
+} ParFor;
+
+#if 0
+pthread_mutex_t stdoutLock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+void *threadfun(void *varg);
+static Job *JobQueue_newSlab(JobQueue * jq);
+static Job *Job_alloc(JobQueue * jq);
+static Job *Job_allocList(JobQueue * jq, long n, Job ** tail);
+static void Job_release(JobQueue * jq, Job * job);
+static int64_t monotonicNs(void);
+static void Job_init(Job * job, int (*jobfun) (void *, void *),
+                     void *param);
+static void JobQueue_runJob(JobQueue * jq, Job * job, void *threadState);
+static void JobQueue_runHere(JobQueue * jq, Job * job);
+static bool JobQueue_helps(JobQueue * jq);
+static bool JobQueue_help(JobQueue * jq);
+static void condNap(pthread_cond_t * cond, pthread_mutex_t * lock);
+static void JobPool_want(JobPool * pool, JobQueue * jq);
+static int JobPool_take(JobPool * pool, JobQueue * jq, int n);
+static void JobPool_give(JobPool * pool, JobQueue * jq);
+static JobQueue *JobPool_grant(JobPool * pool);
+static JobQueue *JobPool_leave(JobPool * pool, JobQueue * jq,
+                               JobQueue * next);
+static void JobPool_hand(JobPool * pool, JobQueue * jq);
+static void JobPool_kick(JobPool * pool, JobQueue * jq);
+static bool JobPool_wanted(JobQueue * jq);
+static JobQueue *Worker_yield(Worker * w);
+static CallerState *CallerState_get(JobQueue * jq);
+static void CallerState_put(JobQueue * jq, CallerState * cs);
+static void Arena_init(Arena * a, size_t size);
+static void *Arena_alloc(Arena * a, size_t n);
+static void Arena_rewind(Arena * a, size_t used, ArenaChunk * overflow);
+static void Arena_free(Arena * a);
+static void Job_discard(JobQueue * jq, Job * job);
+static void Job_done(JobQueue * jq, Job * job, int status);
+static void JobQueue_notify(JobQueue * jq);
+static void JobQueue_recordError(JobQueue * jq, Job * job, int status);
+static void ParFor_finish(ParFor * pf, long ndone);
+static JobHandle *JobHandle_new(JobQueue * jq);
+static void JobHandle_release(JobHandle * h);
+static void JobHandle_finish(JobHandle * h, int status);
+static void Job_predDone(JobQueue * jq, Job * job);
+static void JobGroup_release(JobGroup * g);
+static void CancelToken_release(CancelToken * t);
+static bool Job_skip(Job * job);
+static void JobGroup_finish(JobGroup * g, int status);
+static void JobList_push(JobList * list, Job * head, Job * tail, long n,
+                         JobOrder order);
+static Job *JobList_pop(JobList * list);
+static void JobQueue_heapPush(JobQueue * jq, Job * job);
+static Job *JobQueue_heapPop(JobQueue * jq);
+static void JobQueue_enqueue(JobQueue * jq, Job * head, Job * tail,
+                             long n);
+static Job *JobQueue_dequeue(JobQueue * jq);
+static Job *JobQueue_dequeueFor(JobQueue * jq, Worker * w);
+static void JobQueue_wakeAll(JobQueue * jq);
+static void JobQueue_inboxPush(JobQueue * jq, Job * job);
+static Job *JobQueue_inboxPop(JobQueue * jq, bool *busy);
+static void JobQueue_drain(JobQueue * jq);
+static int JobQueue_reserve(JobQueue * jq, long n);
+static int JobQueue_wake(JobQueue * jq, long njobs);
+static void JobQueue_launch(JobQueue * jq, int n);
+static void JobQueue_push(JobQueue * jq, Job * job);
+static bool JobQueue_waitForRoom(JobQueue * jq, int64_t deadline);
+static int JobQueue_add(JobQueue * jq, int (*jobfun) (void *, void *),
+                        void *param, const void *data, size_t size,
+                        const JobMove * mv, int64_t deadline);
+static int ParFor_run(void *param, void *threadState);
+static bool ParFor_shouldSplit(JobQueue * jq);
+static void ParFor_chunk(ParFor * pf, long lo, long hi, void *threadState);
+static Job *Worker_steal(Worker * w);
+static bool Worker_spin(Worker * w, Job ** job);
+static bool Worker_retire(Worker * w, bool timedOut);
+static void readNodes(int nodeOf[CPU_SETSIZE]);
+static void JobQueue_pin(JobQueue * jq, int ncpu, const int *cpu);
+static int64_t JobQueue_stamp(JobQueue * jq);
+static int histBin(int64_t ns);
+static void JobQueue_trace(JobQueue * jq, int type, const void *job);
+
+JobQueue *JobQueue_new(int maxThreads, void *threadData,
+                       void *(*ThreadState_new) (void *),
+                       void (*ThreadState_free) (void *)) {
+    int i;
+    JobQueue *jq;
+    if(posix_memalign((void **) &jq, JOBQUEUE_CACHE_LINE, sizeof(JobQueue)))
+        jq = NULL;
+    CHECKMEM(jq);
+
+    for(i = 0; i < JOBQUEUE_NPRIORITY; ++i) {
+        jq->todo[i].head = jq->todo[i].tail = NULL;
+        jq->todo[i].len = 0;
+        jq->heapLenByPriority[i] = 0;
+    }
+    jq->order = JOBQUEUE_LIFO;
+    jq->nQueued = 0;
+    jq->capacity = jq->lowWater = 0;
+    jq->nBlocked = 0;
+    jq->nWaiting = jq->nHelping = 0;
+    jq->inStub.next = NULL;
+    jq->inHead = jq->inTail = &jq->inStub;
+    jq->heap = NULL;
+    jq->heapLen = jq->heapCap = 0;
+    jq->agingNs = JOBQUEUE_AGING_NS;
+    jq->stampJobs = false;
+    jq->agingEpoch = 0;
+    jq->nErrors = jq->nDiscarded = 0;
+    jq->firstError = 0;
+    jq->cancelOnError = false;
+    jq->onError = NULL;
+    jq->errData = NULL;
+    jq->acceptingJobs = true;
+    jq->idle = jq->nThreads = jq->nReady = jq->spinning = 0;
+    jq->spinNs = JOBQUEUE_SPIN_NS;
+    jq->multiCore = sysconf(_SC_NPROCESSORS_ONLN) > 1;
+    jq->timing = false;
+    jq->maxQueued = 0;
+    jq->tracing = false;
+    jq->trace = NULL;
+    jq->maxThreads = jq->nSlots = maxThreads;
+    jq->minThreads = 0;
+    jq->idleNs = 0;
+    jq->hiSlot = 0;
+    jq->threadData = threadData;
+    jq->ThreadState_new = ThreadState_new;
+    jq->ThreadState_free = ThreadState_free;
+    jq->workStealing = false;
+    jq->callerHelps = false;
+    jq->deterministic = false;
+    jq->nextSlot = 0;
+    jq->inlineBacklog = 0;
+    jq->pool = NULL;
+    jq->poolNext = NULL;
+    jq->stride = JOBQUEUE_STRIDE1;
+    jq->pass = 0;
+    jq->poolWaiting = false;
+    jq->poolGranted = jq->poolPins = 0;
+    jq->arenaSize = JOBQUEUE_ARENA_SIZE;
+    jq->callers = NULL;
+    jq->doneHead = jq->doneList = NULL;
+    jq->notify = false;
+    jq->notifyFd[0] = jq->notifyFd[1] = -1;
+
+    if(posix_memalign((void **) &jq->workers, JOBQUEUE_CACHE_LINE,
+                      maxThreads * sizeof(jq->workers[0])))
+        jq->workers = NULL;
+    CHECKMEM(jq->workers);
+    if(posix_memalign((void **) &jq->stats, JOBQUEUE_CACHE_LINE,
+                      maxThreads * sizeof(jq->stats[0])))
+        jq->stats = NULL;
+    CHECKMEM(jq->stats);
+    memset(jq->stats, 0, maxThreads * sizeof(jq->stats[0]));
+    for(i = 0; i < maxThreads; ++i) {
+        jq->workers[i].jq = jq;
+        jq->workers[i].index = i;
+        jq->workers[i].deque = NULL;
+        jq->workers[i].cache = NULL;
+        jq->workers[i].ncached = 0;
+        jq->workers[i].spinNs = jq->spinNs;
+        jq->workers[i].cpu = jq->workers[i].node = -1;
+        jq->workers[i].stats = jq->stats + i;
+        jq->workers[i].threadState = NULL;
+        jq->workers[i].state = WORKER_FREE;
+        jq->workers[i].launched = false;
+        jq->workers[i].joinPrev = false;
+        jq->workers[i].dealt.head = jq->workers[i].dealt.tail = NULL;
+        jq->workers[i].dealt.len = 0;
+        jq->workers[i].parked = false;
+    }
+    jq->freeJobs = NULL;
+    jq->slabs = NULL;
+
+    // set attr for joinable threads, which JobQueue_free joins
+    if((i = pthread_attr_init(&jq->attr))) {
+        fprintf(stderr, "%s:%d: pthread_attr_init returned %d (%s)",
+                __FILE__, __LINE__, i, strerror(i));
+        exit(1);
+    }
+    if((i = pthread_attr_setdetachstate(&jq->attr, PTHREAD_CREATE_JOINABLE))) {
+        fprintf(stderr, "%s:%d: pthread_attr_setdetachstate returned %d (%s)",
+                __FILE__, __LINE__, i, strerror(i));
+        exit(1);
+    }
+
+    if((i = pthread_mutex_init(&jq->lock, NULL))) {
+        fprintf(stderr, "%s:%d: pthread_mutex_init returned %d (%s)",
+                __FILE__, __LINE__, i, strerror(i));
+        exit(1);
+    }
+
+    if((i = pthread_mutex_init(&jq->poolLock, NULL))) {
+        fprintf(stderr, "%s:%d: pthread_mutex_init returned %d (%s)",
+                __FILE__, __LINE__, i, strerror(i));
+        exit(1);
+    }
+
+    // Idle and submission timeouts are measured on the monotonic
+    // clock.
+    pthread_condattr_t cattr;
+    if((i = pthread_condattr_init(&cattr))) {
+        fprintf(stderr, "%s:%d: pthread_condattr_init returned %d (%s)",
+                __FILE__, __LINE__, i, strerror(i));
+        exit(1);
+    }
+    if((i = pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC))) {
+        fprintf(stderr, "%s:%d: pthread_condattr_setclock returned %d (%s)",
+                __FILE__, __LINE__, i, strerror(i));
+        exit(1);
+    }
+    if((i = pthread_cond_init(&jq->wakeWorker, &cattr))) {
+        fprintf(stderr, "%s:%d: pthread_cond_init returned %d (%s)",
+                __FILE__, __LINE__, i, strerror(i));
+        exit(1);
+    }
+    if((i = pthread_cond_init(&jq->wakeSubmitter, &cattr))) {
+        fprintf(stderr, "%s:%d: pthread_cond_init returned %d (%s)",
+                __FILE__, __LINE__, i, strerror(i));
+        exit(1);
+    }
+    if((i = pthread_cond_init(&jq->poolWake, &cattr))) {
+        fprintf(stderr, "%s:%d: pthread_cond_init returned %d (%s)",
+                __FILE__, __LINE__, i, strerror(i));
+        exit(1);
+    }
+    for(int k = 0; k < maxThreads; ++k) {
+        if((i = pthread_cond_init(&jq->workers[k].wake, &cattr))) {
+            fprintf(stderr, "%s:%d: pthread_cond_init returned %d (%s)",
+                    __FILE__, __LINE__, i, strerror(i));
+            exit(1);
+        }
+    }
+    pthread_condattr_destroy(&cattr);
+
+    if((i = pthread_cond_init(&jq->wakeMain, NULL))) {
+        fprintf(stderr, "%s:%d: pthread_cond_init returned %d (%s)",
+                __FILE__, __LINE__, i, strerror(i));
+        exit(1);
+    }
+
+    jq->valid = JOBQUEUE_VALID;
+
+    return jq;
+}
+
+/// Current time in nanoseconds, from the monotonic clock
+static int64_t monotonicNs(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return 1000000000L * (int64_t) t.tv_sec + t.tv_nsec;
+}
+
+/// Initialize a job with default priority and no deadline.
+static void Job_init(Job * job, int (*jobfun) (void *, void *),
+                     void *param) {
+    job->jobfun = jobfun;
+    job->param = param;
+    job->lo = job->hi = 0;
+    job->priority = 0;
+    job->moved = false;
+    job->enqueued = 0;
+    job->deadline = 0;
+    job->handle = NULL;
+    job->group = NULL;
+    job->npred = 0;
+    job->expires = 0;
+
+    // Jobs submitted by a job share its token, so that cancelling
+    // the token also stops the work it spawns.
+    job->token = (currJob != NULL ? currJob->token : NULL);
+    if(job->token != NULL)
+        __atomic_add_fetch(&job->token->refs, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Run a job in the current worker, deliver its result to its handle
+ * if it has one, and recycle the node.
+ */
+static void JobQueue_runJob(JobQueue * jq, Job * job, void *threadState) {
+    Job *prev = currJob;
+    int status;
+
+    if((jq->cancelOnError && __atomic_load_n(&jq->nErrors, __ATOMIC_RELAXED))
+       || Job_skip(job)) {
+        Job_discard(jq, job);
+        return;
+    }
+
+    Arena *a = currArena;
+    size_t used = 0;
+    ArenaChunk *overflow = NULL;
+    if(a != NULL) {
+        used = a->used;
+        overflow = a->overflow;
+    }
+
+    currJob = job;
+    status = job->jobfun(job->param, threadState);
+    currJob = prev;
+
+    if(a != NULL)
+        Arena_rewind(a, used, overflow);
+
+    if(status != 0)
+        JobQueue_recordError(jq, job, status);
+    if(job->handle != NULL)
+        JobHandle_finish(job->handle, status);
+    if(job->group != NULL)
+        JobGroup_finish(job->group, status);
+    Job_done(jq, job, status);
+}
+
+/**
+ * Run a job on the calling thread. One of our own workers uses its
+ * own thread state; any other thread borrows a caller state.
+ */
+static void JobQueue_runHere(JobQueue * jq, Job * job) {
+    if(currWorker != NULL && currWorker->jq == jq) {
+        JobQueue_runJob(jq, job, currWorker->threadState);
+        return;
+    }
+    CallerState *cs = CallerState_get(jq);
+    Arena *prev = currArena;
+    currArena = &cs->arena;
+    TRACE(jq, TRACE_START, job);
+    JobQueue_runJob(jq, job, cs->state);
+    TRACE(jq, TRACE_FINISH, job);
+    currArena = prev;
+    CallerState_put(jq, cs);
+}
+
+/**
+ * Return true if a thread that waits on jq should run jq's jobs
+ * meanwhile: always for jq's own workers, which would otherwise tie
+ * up a thread of the pool, and for workers of queues that share a
+ * JobPool with jq, which would tie up a slot that jq may need. Other
+ * threads help in caller-helps mode.
+ */
+static bool JobQueue_helps(JobQueue * jq) {
+    if(currWorker != NULL && currWorker->jq == jq)
+        return true;
+    if(currWorker != NULL && jq->pool != NULL
+       && currWorker->jq->pool == jq->pool)
+        return true;
+    return __atomic_load_n(&jq->callerHelps, __ATOMIC_RELAXED);
+}
+
+/**
+ * Run one of jq's jobs on the calling thread, for a thread that is
+ * waiting. A worker of jq looks first in its own deque, then in the
+ * shared queue, and then in other workers' deques. Other threads use
+ * only the shared queue. Return false if no job was found.
+ *
+ * The job runs on top of the waiter's stack, so a wait that helps
+ * may return only after an unrelated job has finished.
+ */
+static bool JobQueue_help(JobQueue * jq) {
+    int status;
+    Job *job = NULL;
+    Worker *w = currWorker;
+    bool worker = (w != NULL && w->jq == jq);
+
+    if(worker && jq->workStealing)
+        job = Deque_pop(w->deque);
+    if(job == NULL
+       && __atomic_load_n(&jq->nQueued, __ATOMIC_RELAXED) > 0) {
+        status = pthread_mutex_lock(&jq->lock);
+        if(status)
+            ERR(status, "lock");
+        job = JobQueue_dequeueFor(jq, worker ? w : NULL);
+        if(job != NULL && !worker)
+            ++jq->nHelping;
+        status = pthread_mutex_unlock(&jq->lock);
+        if(status)
+            ERR(status, "unlock");
+    }
+    if(job == NULL && worker && jq->workStealing)
+        job = Worker_steal(w);
+    if(job == NULL)
+        return false;
+
+    JobQueue_runHere(jq, job);
+    if(worker) {
+        STAT_ADD(w->stats->jobsRun, 1);
+        return true;
+    }
+
+    // No worker of jq will go idle for this job, so tell
+    // JobQueue_waitOnJobs ourselves.
+    status = pthread_mutex_lock(&jq->lock);
+    if(status)
+        ERR(status, "lock");
+    if(--jq->nHelping == 0) {
+        status = pthread_cond_broadcast(&jq->wakeMain);
+        if(status)
+            ERR(status, "broadcast wakeMain");
+    }
+    status = pthread_mutex_unlock(&jq->lock);
+    if(status)
+        ERR(status, "unlock");
+    return true;
+}
+
+/**
+ * Wait on a condition variable that uses the default clock, but for
+ * no more than JOBQUEUE_NAP_NS. Helping waiters use this, because
+ * nobody signals them when work turns up.
+ */
+static void condNap(pthread_cond_t * cond, pthread_mutex_t * lock) {
+    struct timespec t;
+    clock_gettime(CLOCK_REALTIME, &t);
+    t.tv_nsec += JOBQUEUE_NAP_NS;
+    if(t.tv_nsec >= 1000000000L) {
+        t.tv_nsec -= 1000000000L;
+        ++t.tv_sec;
+    }
+    int status = pthread_cond_timedwait(cond, lock, &t);
+    if(status && status != ETIMEDOUT)
+        ERR(status, "timedwait");
+}
+
+/**
+ * Count jq among the members waiting for a slot. Call with
+ * pool->lock held.
+ */
+static void JobPool_want(JobPool * pool, JobQueue * jq) {
+    if(jq->poolWaiting)
+        return;
+
+    // A queue that has not been waiting starts at the current pass,
+    // rather than with credit for the time it was away.
+    if(jq->pass < pool->pass)
+        jq->pass = pool->pass;
+    __atomic_store_n(&jq->poolWaiting, true, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&pool->nWaiting, 1, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Take up to n slots for new workers of jq: first those granted to
+ * it, then free ones. If that isn't enough, count jq among the
+ * waiters, without blocking. Call with jq->lock held. Return the
+ * number taken.
+ */
+static int JobPool_take(JobPool * pool, JobQueue * jq, int n) {
+    int k, status = pthread_mutex_lock(&pool->lock);
+    if(status)
+        ERR(status, "lock pool");
+    k = (n < jq->poolGranted ? n : jq->poolGranted);
+    jq->poolGranted -= k;
+    while(k < n && pool->nFree > 0) {
+        --pool->nFree;
+        ++k;
+    }
+    if(k < n)
+        JobPool_want(pool, jq);
+    status = pthread_mutex_unlock(&pool->lock);
+    if(status)
+        ERR(status, "unlock pool");
+    return k;
+}
+
+/**
+ * Grant a slot to jq, which is waiting, and pin jq until the slot
+ * has been used; see JobPool_hand. Call with pool->lock held.
+ */
+static void JobPool_give(JobPool * pool, JobQueue * jq) {
+    pool->pass = jq->pass;
+    jq->pass += jq->stride;
+    __atomic_store_n(&jq->poolWaiting, false, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&pool->nWaiting, 1, __ATOMIC_SEQ_CST);
+    ++jq->poolGranted;
+    ++jq->poolPins;
+}
+
+/**
+ * Pass a slot to the waiting queue with lowest pass, or free it.
+ * Call with pool->lock held. Return the queue, which the caller must
+ * pass to JobPool_hand once it holds no lock, or NULL.
+ */
+static JobQueue *JobPool_grant(JobPool * pool) {
+    JobQueue *m, *best = NULL;
+    for(m = pool->members; m != NULL; m = m->poolNext) {
+        if(m->poolWaiting && (best == NULL || m->pass < best->pass))
+            best = m;
+    }
+    if(best == NULL)
+        ++pool->nFree;
+    else
+        JobPool_give(pool, best);
+    return best;
+}
+
+/**
+ * Give up the slot of a worker of jq that is exiting. If jq still
+ * has queued jobs, it waits for another slot. If next is not NULL,
+ * the slot has already been given to it. Call with jq->lock held.
+ * Return the queue to pass to JobPool_hand, or NULL.
+ */
+static JobQueue *JobPool_leave(JobPool * pool, JobQueue * jq,
+                               JobQueue * next) {
+    int status = pthread_mutex_lock(&pool->lock);
+    if(status)
+        ERR(status, "lock pool");
+    if(jq->nThreads < jq->maxThreads
+       && __atomic_load_n(&jq->nQueued, __ATOMIC_RELAXED) > 0)
+        JobPool_want(pool, jq);
+    if(next == NULL)
+        next = JobPool_grant(pool);
+    status = pthread_mutex_unlock(&pool->lock);
+    if(status)
+        ERR(status, "unlock pool");
+    return next;
+}
+
+/**
+ * Launch workers of jq, which has been granted a slot and pinned, to
+ * run its queued jobs. A slot that jq no longer needs goes to the
+ * next waiting queue, and so on. Call without holding any lock.
+ */
+static void JobPool_hand(JobPool * pool, JobQueue * jq) {
+    while(jq != NULL) {
+        int status = pthread_mutex_lock(&jq->lock);
+        if(status)
+            ERR(status, "lock");
+        int nlaunch = JobQueue_wake(jq, __atomic_load_n(&jq->nQueued,
+                                                        __ATOMIC_RELAXED));
+        status = pthread_mutex_unlock(&jq->lock);
+        if(status)
+            ERR(status, "unlock");
+        JobQueue_launch(jq, nlaunch);
+
+        status = pthread_mutex_lock(&pool->lock);
+        if(status)
+            ERR(status, "lock pool");
+        JobQueue *next = NULL;
+        if(jq->poolGranted > 0) {
+            --jq->poolGranted;
+            next = JobPool_grant(pool);
+        }
+        if(--jq->poolPins == 0) {
+            status = pthread_cond_broadcast(&jq->poolWake);
+            if(status)
+                ERR(status, "broadcast poolWake");
+        }
+        status = pthread_mutex_unlock(&pool->lock);
+        if(status)
+            ERR(status, "unlock pool");
+        jq = next;
+    }
+}
+
+/**
+ * Wake the parked workers of other members, so that they exit and
+ * free their slots for jq, which is waiting for one. Call without
+ * holding any lock. Each member is pinned while we use its lock, so
+ * that JobQueue_free can't destroy it meanwhile.
+ *
+ * A worker counts itself idle before it checks JobPool_wanted, and
+ * then keeps its queue's lock until it parks. So either it sees that
+ * jq is waiting, or we see it idle and wake it once it has parked.
+ */
+static void JobPool_kick(JobPool * pool, JobQueue * jq) {
+    int status = pthread_mutex_lock(&pool->lock);
+    if(status)
+        ERR(status, "lock pool");
+    JobQueue *m = pool->members;
+    while(m != NULL) {
+        if(m == jq || __atomic_load_n(&m->idle, __ATOMIC_SEQ_CST) == 0) {
+            m = m->poolNext;
+            continue;
+        }
+        ++m->poolPins;
+        status = pthread_mutex_unlock(&pool->lock);
+        if(status)
+            ERR(status, "unlock pool");
+
+        status = pthread_mutex_lock(&m->lock);
+        if(status)
+            ERR(status, "lock");
+        status = pthread_cond_broadcast(&m->wakeWorker);
+        if(status)
+            ERR(status, "broadcast wakeWorker");
+        status = pthread_mutex_unlock(&m->lock);
+        if(status)
+            ERR(status, "unlock");
+
+        status = pthread_mutex_lock(&pool->lock);
+        if(status)
+            ERR(status, "lock pool");
+        JobQueue *next = m->poolNext;
+        if(--m->poolPins == 0) {
+            status = pthread_cond_broadcast(&m->poolWake);
+            if(status)
+                ERR(status, "broadcast poolWake");
+        }
+        m = next;
+    }
+    status = pthread_mutex_unlock(&pool->lock);
+    if(status)
+        ERR(status, "unlock pool");
+}
+
+/// Return true if a member of jq's pool other than jq is waiting for
+/// a slot, so that an idle worker of jq should exit.
+static bool JobPool_wanted(JobQueue * jq) {
+    if(jq->pool == NULL)
+        return false;
+    int self = __atomic_load_n(&jq->poolWaiting, __ATOMIC_RELAXED);
+    return __atomic_load_n(&jq->pool->nWaiting, __ATOMIC_SEQ_CST) > self;
+}
+
+/**
+ * Between jobs, decide whether to yield the worker's slot. When the
+ * worker has run for a time slice and a member with lower pass is
+ * waiting, the slot goes to that member, and the worker must exit.
+ * If the waiters all have higher passes, our queue keeps the slot
+ * and pays a stride for another slice. A worker with jobs in its
+ * deque keeps its slot. Return the member given the slot, or NULL.
+ */
+static JobQueue *Worker_yield(Worker * w) {
+    JobQueue *jq = w->jq, *m, *best = NULL;
+    JobPool *pool = jq->pool;
+    int64_t now;
+
+    if(__atomic_load_n(&pool->nWaiting, __ATOMIC_RELAXED) == 0
+       || (now = monotonicNs()) - w->heldSince < JOBQUEUE_SLICE_NS
+       || (jq->workStealing && !Deque_empty(w->deque)))
+        return NULL;
+
+    int status = pthread_mutex_lock(&pool->lock);
+    if(status)
+        ERR(status, "lock pool");
+    for(m = pool->members; m != NULL; m = m->poolNext) {
+        if(m->poolWaiting && (best == NULL || m->pass < best->pass))
+            best = m;
+    }
+    if(best != NULL && best->pass < jq->pass)
+        JobPool_give(pool, best);
+    else {
+        if(best != NULL) {
+            pool->pass = jq->pass;
+            jq->pass += jq->stride;
+        }
+        best = NULL;
+    }
+    status = pthread_mutex_unlock(&pool->lock);
+    if(status)
+        ERR(status, "unlock pool");
+    w->heldSince = now;
+    return best;
+}
+
+/**
+ * Create a pool of nthreads worker threads that several queues can
+ * share, so that all of them together have no more than nthreads
+ * workers. If nthreads <= 0, use the number of processors online.
+ *
+ * Each worker still belongs to one member queue, and has that
+ * queue's thread state. A thread moves between members by exiting
+ * and being launched anew, as described at JobQueue_setPool.
+ */
+JobPool *JobPool_new(int nthreads) {
+    int status;
+
+    if(nthreads <= 0)
+        nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if(nthreads <= 0)
+        nthreads = 1;
+    JobPool *pool = malloc(sizeof(JobPool));
+    CHECKMEM(pool);
+    if((status = pthread_mutex_init(&pool->lock, NULL)))
+        ERR(status, "mutex_init");
+    pool->nSlots = pool->nFree = nthreads;
+    pool->nWaiting = 0;
+    pool->pass = 0;
+    pool->members = NULL;
+    return pool;
+}
+
+/// Free a pool. Every member queue must already have been freed.
+void JobPool_free(JobPool * pool) {
+    if(pool == NULL)
+        return;
+    if(pool->members != NULL) {
+        fprintf(stderr, "%s:%s:%d: JobPool still has queues\n",
+                __FILE__, __func__, __LINE__);
+        exit(1);
+    }
+    assert(pool->nFree == pool->nSlots);
+    int status = pthread_mutex_destroy(&pool->lock);
+    if(status)
+        ERR(status, "destroy pool lock");
+    free(pool);
+}
+
+/**
+ * Make jq a member of a shared pool, with the given weight, which
+ * must be positive. jq keeps its own thread states and waits, and
+ * launches workers as usual, up to its own maxThreads, but only
+ * while the pool has threads to spare. When it has none, jq waits
+ * for one: idle workers of other members exit at once to make room,
+ * whatever their minThreads, and busy ones exit between jobs once
+ * they have run for a time slice. While several queues have work,
+ * threads go to them in proportion to their weights. Each move costs
+ * a thread exit and launch, and a new thread state.
+ *
+ * A worker of a member that waits on a handle, group, or queue of
+ * another member runs that queue's jobs meanwhile, with a caller
+ * state, as in caller-helps mode. A member's idle timeout, if any,
+ * still applies. Deterministic queues can't be members. Must be
+ * called before the first job is added. Free jq before the pool.
+ */
+void JobQueue_setPool(JobQueue * jq, JobPool * pool, int weight) {
+    int status;
+
+    CHECKVALID(jq);
+    if(jq->nThreads > 0) {
+        fprintf(stderr, "%s:%s:%d: JobQueue already running\n",
+                __FILE__, __func__, __LINE__);
+        exit(1);
+    }
+    if(weight < 1 || jq->pool != NULL) {
+        fprintf(stderr, "%s:%s:%d: bad weight (%d) or pool already set\n",
+                __FILE__, __func__, __LINE__, weight);
+        exit(1);
+    }
+    if(jq->deterministic) {
+        fprintf(stderr, "%s:%s:%d: deterministic queues can't share"
+                " a pool\n", __FILE__, __func__, __LINE__);
+        exit(1);
+    }
+    status = pthread_mutex_lock(&pool->lock);
+    if(status)
+        ERR(status, "lock pool");
+    jq->pool = pool;
+    jq->stride = JOBQUEUE_STRIDE1 / weight;
+    jq->pass = pool->pass;
+    jq->poolNext = pool->members;
+    pool->members = jq;
+    status = pthread_mutex_unlock(&pool->lock);
+    if(status)
+        ERR(status, "unlock pool");
+}
+
+/// Take a caller state from the list, or make a new one.
+static CallerState *CallerState_get(JobQueue * jq) {
+    int status;
+    CallerState *cs;
+
+    status = pthread_mutex_lock(&jq->poolLock);
+    if(status)
+        ERR(status, "lock poolLock");
+    cs = jq->callers;
+    if(cs != NULL)
+        jq->callers = cs->next;
+    status = pthread_mutex_unlock(&jq->poolLock);
+    if(status)
+        ERR(status, "unlock poolLock");
+    if(cs != NULL)
+        return cs;
+
+    cs = malloc(sizeof(CallerState));
+    CHECKMEM(cs);
+    Arena_init(&cs->arena, jq->arenaSize);
+    cs->state = NULL;
+    if(jq->ThreadState_new != NULL) {
+        cs->state = jq->ThreadState_new(jq->threadData);
+        CHECKMEM(cs->state);
+    }
+    return cs;
+}
+
+/// Return a caller state to the list, for reuse.
+static void CallerState_put(JobQueue * jq, CallerState * cs) {
+    int status;
+
+    status = pthread_mutex_lock(&jq->poolLock);
+    if(status)
+        ERR(status, "lock poolLock");
+    cs->next = jq->callers;
+    jq->callers = cs;
+    status = pthread_mutex_unlock(&jq->poolLock);
+    if(status)
+        ERR(status, "unlock poolLock");
+}
+
+static void Arena_init(Arena * a, size_t size) {
+    a->base = NULL;
+    a->size = size;
+    a->used = 0;
+    a->overflow = NULL;
+}
+
+/// Return n bytes of scratch memory, aligned to JOBQUEUE_ARENA_ALIGN.
+static void *Arena_alloc(Arena * a, size_t n) {
+    n = (n + JOBQUEUE_ARENA_ALIGN - 1) & ~(size_t) (JOBQUEUE_ARENA_ALIGN - 1);
+    if(a->base == NULL && a->size > 0) {
+        if(posix_memalign((void **) &a->base, JOBQUEUE_CACHE_LINE, a->size))
+            a->base = NULL;
+        CHECKMEM(a->base);
+    }
+    if(n <= a->size - a->used) {
+        void *p = a->base + a->used;
+        a->used += n;
+        return p;
+    }
+    ArenaChunk *c = malloc(sizeof(ArenaChunk) + n);
+    CHECKMEM(c);
+    c->next = a->overflow;
+    a->overflow = c;
+    return c->mem;
+}
+
+/// Free everything allocated since the arena had this state.
+static void Arena_rewind(Arena * a, size_t used, ArenaChunk * overflow) {
+    while(a->overflow != overflow) {
+        ArenaChunk *c = a->overflow;
+        a->overflow = c->next;
+        free(c);
+    }
+    a->used = used;
+}
+
+static void Arena_free(Arena * a) {
+    Arena_rewind(a, 0, NULL);
+    free(a->base);
+    a->base = NULL;
+}
+
+/**
+ * Return n bytes of scratch memory, aligned to 16 bytes, from the
+ * calling thread's arena. The memory lasts until the current job
+ * returns, and needs no freeing. Each thread that runs jobs has an
+ * arena of its own (see JobQueue_setArenaSize); when it is used up,
+ * larger requests fall back on malloc, and are still freed when the
+ * job returns. Returns NULL outside of a job.
+ */
+void *JobQueue_scratch(size_t n) {
+    if(currJob == NULL || currArena == NULL)
+        return NULL;
+    return Arena_alloc(currArena, n);
+}
+
+/**
+ * Set the size, in bytes, of each thread's scratch arena. The memory
+ * is allocated the first time a thread calls JobQueue_scratch.
+ * Default: JOBQUEUE_ARENA_SIZE. Must be called before the first job
+ * is added.
+ */
+void JobQueue_setArenaSize(JobQueue * jq, size_t bytes) {
+    CHECKVALID(jq);
+    if(jq->nThreads > 0) {
+        fprintf(stderr, "%s:%s:%d: JobQueue already running\n",
+                __FILE__, __func__, __LINE__);
+        exit(1);
+    }
+    jq->arenaSize = bytes;
+}
+
+/**
+ * Dispose of a job without running it. Its handle, if any, finishes
+ * with status ECANCELED.
+ */
+static void Job_discard(JobQueue * jq, Job * job) {
+    __atomic_add_fetch(&jq->nDiscarded, 1, __ATOMIC_RELAXED);
+    if(job->jobfun == ParFor_run) {
+        ParFor *pf = (ParFor *) job->param;
+        int zero = 0;
+        __atomic_compare_exchange_n(&pf->status, &zero, ECANCELED, false,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+        ParFor_finish(pf, job->hi - job->lo);
+    }
+    if(job->handle != NULL)
+        JobHandle_finish(job->handle, ECANCELED);
+    if(job->group != NULL)
+        JobGroup_finish(job->group, ECANCELED);
+    if(job->moved)
+        job->drop(job->data);
+    Job_done(jq, job, ECANCELED);
+}
+
+/**
+ * Recycle the node of a finished job, or, if completions are being
+ * reported, push it onto the completion stack. The write that makes
+ * JobQueue_completionFd readable happens only when the stack was
+ * empty, so a busy queue makes one system call per batch that the
+ * consumer takes, not one per job.
+ */
+static void Job_done(JobQueue * jq, Job * job, int status) {
+    if(!jq->notify || job->jobfun == ParFor_run) {
+        Job_release(jq, job);
+        return;
+    }
+    if(job->token != NULL) {
+        CancelToken_release(job->token);
+        job->token = NULL;
+    }
+    job->status = status;
+    Job *head = __atomic_load_n(&jq->doneHead, __ATOMIC_RELAXED);
+    do {
+        job->next = head;
+    } while(!__atomic_compare_exchange_n(&jq->doneHead, &head, job, true,
+                                         __ATOMIC_RELEASE,
+                                         __ATOMIC_RELAXED));
+    if(head == NULL)
+        JobQueue_notify(jq);
+}
+
+/// Make the completion descriptor readable.
+static void JobQueue_notify(JobQueue * jq) {
+    uint64_t one = 1;
+    ssize_t n;
+    do {
+        n = write(jq->notifyFd[1], &one, sizeof one);
+    } while(n < 0 && errno == EINTR);
+    // EAGAIN means a full pipe or counter, which is readable anyway.
+    if(n < 0 && errno != EAGAIN)
+        ERR(errno, "write");
+}
+
+/**
+ * Count a failed job, remember the first failure, and call the error
+ * callback. In cancel-on-error mode, discard everything in the shared
+ * queue and in the workers' deques.
+ */
+static void JobQueue_recordError(JobQueue * jq, Job * job, int status) {
+    int zero = 0, s, i;
+    Job *list = NULL, *j;
+
+    __atomic_compare_exchange_n(&jq->firstError, &zero, status, false,
+                                __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&jq->nErrors, 1, __ATOMIC_SEQ_CST);
+
+    if(jq->onError != NULL)
+        jq->onError(jq->errData, status, job->param);
+
+    if(!jq->cancelOnError)
+        return;
+
+    s = pthread_mutex_lock(&jq->lock);
+    if(s)
+        ERR(s, "lock");
+    if(jq->deterministic) {
+        for(i = 0; i < jq->nSlots; ++i) {
+            while((j = JobQueue_dequeueFor(jq, jq->workers + i)) != NULL) {
+                j->next = list;
+                list = j;
+            }
+        }
+    }
+    while((j = JobQueue_dequeue(jq)) != NULL) {
+        j->next = list;
+        list = j;
+    }
+    s = pthread_mutex_unlock(&jq->lock);
+    if(s)
+        ERR(s, "unlock");
+
+    if(jq->workStealing) {
+        int n = __atomic_load_n(&jq->hiSlot, __ATOMIC_ACQUIRE);
+        for(i = 0; i < n; ++i) {
+            void *p;
+            while((p = Deque_steal(jq->workers[i].deque)) != NULL) {
+                if(p == DEQUE_ABORT)
+                    continue;
+                j = (Job *) p;
+                j->next = list;
+                list = j;
+            }
+        }
+    }
+
+    while(list != NULL) {
+        j = list;
+        list = list->next;
+        Job_discard(jq, j);
+    }
+}
+
+/**
+ * Insert the chain of n jobs from head to tail into list: at the
+ * front for LIFO order or at the back for FIFO.
+ */
+static void JobList_push(JobList * list, Job * head, Job * tail, long n,
+                         JobOrder order) {
+    list->len += n;
+    if(list->head == NULL) {
+        tail->next = NULL;
+        list->head = head;
+        list->tail = tail;
+    } else if(order == JOBQUEUE_FIFO) {
+        tail->next = NULL;
+        list->tail->next = head;
+        list->tail = tail;
+    } else {
+        tail->next = list->head;
+        list->head = head;
+    }
+}
+
+/// Remove and return the job at the front of list, or NULL.
+static Job *JobList_pop(JobList * list) {
+    Job *job = list->head;
+    if(job != NULL) {
+        list->head = job->next;
+        if(list->head == NULL)
+            list->tail = NULL;
+        --list->len;
+    }
+    return job;
+}
+
+/// Add a job to the deadline heap. Call with jq->lock held.
+static void JobQueue_heapPush(JobQueue * jq, Job * job) {
+    long i, parent;
+
+    if(jq->heapLen == jq->heapCap) {
+        jq->heapCap = (jq->heapCap == 0 ? 16 : 2 * jq->heapCap);
+        jq->heap = realloc(jq->heap, jq->heapCap * sizeof(jq->heap[0]));
+        CHECKMEM(jq->heap);
+    }
+
+    // sift up
+    for(i = jq->heapLen++; i > 0; i = parent) {
+        parent = (i - 1) / 2;
+        if(jq->heap[parent]->deadline <= job->deadline)
+            break;
+        jq->heap[i] = jq->heap[parent];
+    }
+    jq->heap[i] = job;
+    ++jq->heapLenByPriority[job->priority];
+}
+
+/// Remove the job with the earliest deadline. Call with lock held.
+static Job *JobQueue_heapPop(JobQueue * jq) {
+    long i, child;
+    Job *top, *last;
+
+    assert(jq->heapLen > 0);
+    top = jq->heap[0];
+    last = jq->heap[--jq->heapLen];
+
+    // sift down
+    for(i = 0; (child = 2 * i + 1) < jq->heapLen; i = child) {
+        if(child + 1 < jq->heapLen
+           && jq->heap[child + 1]->deadline < jq->heap[child]->deadline)
+            ++child;
+        if(last->deadline <= jq->heap[child]->deadline)
+            break;
+        jq->heap[i] = jq->heap[child];
+    }
+    jq->heap[i] = last;
+    --jq->heapLenByPriority[top->priority];
+    return top;
+}
+
+/**
+ * Add a chain of n jobs, all with the same priority, to the shared
+ * queue. Only a single job may have a deadline. Call with jq->lock
+ * held.
+ */
+static void JobQueue_enqueue(JobQueue * jq, Job * head, Job * tail,
+                             long n) {
+    if(jq->deterministic) {
+        // Deal the jobs out to the workers in turn.
+        for(long i = 0; i < n; ++i) {
+            Job *next = head->next;
+            Worker *w = jq->workers + jq->nextSlot;
+            if(++jq->nextSlot == jq->nSlots)
+                jq->nextSlot = 0;
+            JobList_push(&w->dealt, head, head, 1, JOBQUEUE_FIFO);
+            if(w->parked) {
+                int status = pthread_cond_signal(&w->wake);
+                if(status)
+                    ERR(status, "signal wake");
+            }
+            head = next;
+        }
+        long nQueued = __atomic_add_fetch(&jq->nQueued, n, __ATOMIC_RELAXED);
+        if(nQueued > jq->maxQueued)
+            jq->maxQueued = nQueued;
+        return;
+    }
+
+    // Keep jobs already in the inbox ahead of these.
+    JobQueue_drain(jq);
+    if(head->deadline != 0) {
+        assert(n == 1);
+        JobQueue_heapPush(jq, head);
+    } else
+        JobList_push(jq->todo + head->priority, head, tail, n, jq->order);
+    long nQueued = __atomic_add_fetch(&jq->nQueued, n, __ATOMIC_RELAXED);
+    if(nQueued > jq->maxQueued)
+        jq->maxQueued = nQueued;
+}
+
+/**
+ * Push a job onto the inbox. Lock-free: the only contended operation
+ * is a single atomic exchange. The caller counts the job in nQueued.
+ */
+static void JobQueue_inboxPush(JobQueue * jq, Job * job) {
+    __atomic_store_n(&job->next, NULL, __ATOMIC_RELAXED);
+    Job *prev = __atomic_exchange_n(&jq->inHead, job, __ATOMIC_ACQ_REL);
+
+    // Until this store, the inbox is broken between prev and job.
+    __atomic_store_n(&prev->next, job, __ATOMIC_RELEASE);
+}
+
+/**
+ * Pop the oldest job from the inbox. Caller must hold jq->lock.
+ * Return NULL if the inbox is empty, or if a submitter is part way
+ * through a push, in which case set *busy.
+ */
+static Job *JobQueue_inboxPop(JobQueue * jq, bool *busy) {
+    Job *tail = jq->inTail;
+    Job *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    *busy = false;
+    if(tail == &jq->inStub) {
+        if(next == NULL) {
+            *busy = (__atomic_load_n(&jq->inHead, __ATOMIC_ACQUIRE) != tail);
+            return NULL;
+        }
+        jq->inTail = tail = next;
+        next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    }
+    if(next != NULL) {
+        jq->inTail = next;
+        return tail;
+    }
+    if(__atomic_load_n(&jq->inHead, __ATOMIC_ACQUIRE) != tail) {
+        *busy = true;
+        return NULL;
+    }
+
+    // tail is the last job: put the stub behind it.
+    JobQueue_inboxPush(jq, &jq->inStub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if(next != NULL) {
+        jq->inTail = next;
+        return tail;
+    }
+    *busy = true;
+    return NULL;
+}
+
+/**
+ * Move every job in the inbox onto todo[0], in the order pushed.
+ * Caller must hold jq->lock. If a submitter has been preempted in
+ * the middle of a push, wait for it, so that every job counted in
+ * nQueued is on the lists when this returns.
+ */
+static void JobQueue_drain(JobQueue * jq) {
+    Job *job;
+    bool busy;
+
+    for(;;) {
+        job = JobQueue_inboxPop(jq, &busy);
+        if(job != NULL) {
+            JobList_push(jq->todo, job, job, 1, jq->order);
+            continue;
+        }
+        if(!busy)
+            break;
+        sched_yield();
+    }
+    long nQueued = __atomic_load_n(&jq->nQueued, __ATOMIC_RELAXED);
+    if(nQueued > jq->maxQueued)
+        jq->maxQueued = nQueued;
+}
+
+/**
+ * Remove and return the next job from the shared queue, or NULL if
+ * it is empty. Call with jq->lock held.
+ *
+ * A job whose deadline is near or past comes first, earliest
+ * deadline first. Otherwise, the job at the front of the highest
+ * priority list wins, but with aging, each job's priority is raised
+ * by one level for each agingNs nanoseconds it has waited. Aging uses
+ * the age of the job at the front of each list, so in LIFO order it
+ * prevents starvation between priority levels but not within one.
+ */
+static Job *JobQueue_dequeue(JobQueue * jq) {
+    int p, best = -1;
+    int64_t now = 0, t;
+    double score, bestScore = -1.0;
+    bool aging = jq->stampJobs && jq->agingNs > 0;
+    Job *job;
+
+    if(__atomic_load_n(&jq->nQueued, __ATOMIC_RELAXED) == 0)
+        return NULL;
+    JobQueue_drain(jq);
+
+    if(jq->heapLen > 0 || aging)
+        now = monotonicNs();
+
+    long left = __atomic_sub_fetch(&jq->nQueued, 1, __ATOMIC_RELAXED);
+    if(jq->nBlocked > 0 && left <= jq->lowWater) {
+        int status = pthread_cond_broadcast(&jq->wakeSubmitter);
+        if(status)
+            ERR(status, "broadcast wakeSubmitter");
+    }
+
+    if(jq->heapLen > 0
+       && jq->heap[0]->deadline - now <= JOBQUEUE_DEADLINE_SLACK_NS)
+        return JobQueue_heapPop(jq);
+
+    for(p = JOBQUEUE_NPRIORITY - 1; p >= 0; --p) {
+        job = jq->todo[p].head;
+        if(job == NULL)
+            continue;
+        score = p;
+        if(aging) {
+            t = (job->enqueued ? job->enqueued : jq->agingEpoch);
+            score += (now - t) / (double) jq->agingNs;
+        }
+        if(score > bestScore) {
+            bestScore = score;
+            best = p;
+        }
+        if(!aging)
+            break;              // without aging, the first is best
+    }
+
+    if(jq->heapLen > 0) {
+        job = jq->heap[0];
+        score = job->priority;
+        if(aging)
+            score += (now - job->enqueued) / (double) jq->agingNs;
+        if(score > bestScore)
+            return JobQueue_heapPop(jq);
+    }
+
+    assert(best >= 0);
+    return JobList_pop(jq->todo + best);
+}
+
+/**
+ * Remove and return the next job for worker w, or for a thread
+ * outside the pool if w is NULL. Return NULL if there is none. In
+ * deterministic mode, each worker takes only the jobs dealt to it,
+ * and other threads take none. Call with jq->lock held.
+ */
+static Job *JobQueue_dequeueFor(JobQueue * jq, Worker * w) {
+    if(!jq->deterministic)
+        return JobQueue_dequeue(jq);
+    if(w == NULL || w->dealt.head == NULL)
+        return NULL;
+
+    long left = __atomic_sub_fetch(&jq->nQueued, 1, __ATOMIC_RELAXED);
+    if(jq->nBlocked > 0 && left <= jq->lowWater) {
+        int status = pthread_cond_broadcast(&jq->wakeSubmitter);
+        if(status)
+            ERR(status, "broadcast wakeSubmitter");
+    }
+    return JobList_pop(&w->dealt);
+}
+
+/**
+ * Wake every parked worker, so that it can check whether to quit.
+ * Call with jq->lock held.
+ */
+static void JobQueue_wakeAll(JobQueue * jq) {
+    int status = pthread_cond_broadcast(&jq->wakeWorker);
+    if(status)
+        ERR(status, "broadcast wakeWorker");
+    if(!jq->deterministic)
+        return;
+    for(int i = 0; i < jq->nSlots; ++i) {
+        if(!jq->workers[i].parked)
+            continue;
+        status = pthread_cond_signal(&jq->workers[i].wake);
+        if(status)
+            ERR(status, "signal wake");
+    }
+}
+
+/**
+ * Allocate a slab of Job nodes, link them into a list, and return the
+ * head of that list. Call with jq->poolLock held.
+ */
+static Job *JobQueue_newSlab(JobQueue * jq) {
+    int i;
+    Slab *slab;
+    size_t size = sizeof(Slab) + JOBQUEUE_SLAB_JOBS * sizeof(Job);
+
+    // posix_memalign wants a size that is a multiple of the alignment
+    size = (size + JOBQUEUE_CACHE_LINE - 1)
+        & ~(size_t) (JOBQUEUE_CACHE_LINE - 1);
+    i = posix_memalign((void **) &slab, JOBQUEUE_CACHE_LINE, size);
+    if(i)
+        ERR(i, "posix_memalign");
+    slab->next = jq->slabs;
+    jq->slabs = slab;
+
+    for(i = 0; i < JOBQUEUE_SLAB_JOBS - 1; ++i)
+        slab->jobs[i].next = slab->jobs + i + 1;
+    slab->jobs[JOBQUEUE_SLAB_JOBS - 1].next = NULL;
+    return slab->jobs;
+}
+
+/**
+ * Get a free Job node. A worker of this queue takes it from its own
+ * cache, refilling the cache from the shared pool when it runs dry.
+ * Other threads take nodes from the shared pool one at a time. New
+ * slabs are allocated only when the pool is empty.
+ */
+static Job *Job_alloc(JobQueue * jq) {
+    int status;
+    Job *job;
+    Worker *w = currWorker;
+
+    if(w != NULL && w->jq == jq && w->cache != NULL) {
+        job = w->cache;
+        w->cache = job->next;
+        --w->ncached;
+        return job;
+    }
+
+    status = pthread_mutex_lock(&jq->poolLock);
+    if(status)
+        ERR(status, "lock poolLock");
+
+    if(jq->freeJobs == NULL)
+        jq->freeJobs = JobQueue_newSlab(jq);
+
+    job = jq->freeJobs;
+    jq->freeJobs = job->next;
+
+    if(w != NULL && w->jq == jq) {
+        // refill this worker's cache
+        while(w->ncached < JOBQUEUE_CACHE_BATCH && jq->freeJobs != NULL) {
+            Job *j = jq->freeJobs;
+            jq->freeJobs = j->next;
+            j->next = w->cache;
+            w->cache = j;
+            ++w->ncached;
+        }
+    }
+
+    status = pthread_mutex_unlock(&jq->poolLock);
+    if(status)
+        ERR(status, "unlock poolLock");
+    return job;
+}
+
+/**
+ * Get a list of n free Job nodes from the shared pool, taking the
+ * lock only once. On return, *tail points to the last node in the
+ * list.
+ */
+static Job *Job_allocList(JobQueue * jq, long n, Job ** tail) {
+    int status;
+    Job *head = NULL, *last = NULL;
+
+    assert(n > 0);
+    status = pthread_mutex_lock(&jq->poolLock);
+    if(status)
+        ERR(status, "lock poolLock");
+
+    while(n > 0) {
+        if(jq->freeJobs == NULL)
+            jq->freeJobs = JobQueue_newSlab(jq);
+
+        // walk to the end of the free list, or to the n'th node
+        Job *first = jq->freeJobs, *j = first;
+        --n;
+        while(n > 0 && j->next != NULL) {
+            j = j->next;
+            --n;
+        }
+        jq->freeJobs = j->next;
+        j->next = NULL;
+        if(last == NULL)
+            head = first;
+        else
+            last->next = first;
+        last = j;
+    }
+
+    status = pthread_mutex_unlock(&jq->poolLock);
+    if(status)
+        ERR(status, "unlock poolLock");
+    *tail = last;
+    return head;
+}
+
+/**
+ * Return a Job node to the current worker's cache. When the cache
+ * overflows, move a batch of nodes back to the shared pool. Threads
+ * outside the pool, which run jobs only now and then, return nodes
+ * to the pool directly.
+ */
+static void Job_release(JobQueue * jq, Job * job) {
+    int status;
+    Worker *w = currWorker;
+
+    if(job->token != NULL) {
+        CancelToken_release(job->token);
+        job->token = NULL;
+    }
+
+    if(w == NULL || w->jq != jq) {
+        status = pthread_mutex_lock(&jq->poolLock);
+        if(status)
+            ERR(status, "lock poolLock");
+        job->next = jq->freeJobs;
+        jq->freeJobs = job;
+        status = pthread_mutex_unlock(&jq->poolLock);
+        if(status)
+            ERR(status, "unlock poolLock");
+        return;
+    }
+    job->next = w->cache;
+    w->cache = job;
+    if(++w->ncached <= 2 * JOBQUEUE_CACHE_BATCH)
+        return;
+
+    // Detach a batch and splice it onto the pool.
+    Job *head = w->cache, *tail = head;
+    for(int i = 1; i < JOBQUEUE_CACHE_BATCH; ++i)
+        tail = tail->next;
+    w->cache = tail->next;
+    w->ncached -= JOBQUEUE_CACHE_BATCH;
+
+    status = pthread_mutex_lock(&jq->poolLock);
+    if(status)
+        ERR(status, "lock poolLock");
+    tail->next = jq->freeJobs;
+    jq->freeJobs = head;
+    status = pthread_mutex_unlock(&jq->poolLock);
+    if(status)
+        ERR(status, "unlock poolLock");
+}
+
+/**
+ * Choose the order in which jobs on the shared queue are run:
+ * JOBQUEUE_LIFO (the default) runs the most recently added job
+ * first, and JOBQUEUE_FIFO runs the oldest first. Jobs that are
+ * already queued keep their places.
+ */
+void JobQueue_setOrder(JobQueue * jq, JobOrder order) {
+    int status;
+
+    CHECKVALID(jq);
+    status = pthread_mutex_lock(&jq->lock);
+    if(status)
+        ERR(status, "lock");
+    jq->order = order;
+    status = pthread_mutex_unlock(&jq->lock);
+    if(status)
+        ERR(status, "unlock");
+}
+
+/**
+ * Fill nodeOf[cpu] with the NUMA node of each CPU, as listed in
+ * /sys/devices/system/node. CPUs that are not listed, or all CPUs if
+ * the system provides no node information, go on node 0.
+ */
+static void readNodes(int nodeOf[CPU_SETSIZE]) {
+    char fname[300], buff[1024];
+    int node, i, lo, hi;
+    struct dirent *entry;
+    DIR *dir;
+
+    for(i = 0; i < CPU_SETSIZE; ++i)
+        nodeOf[i] = 0;
+
+    dir = opendir("/sys/devices/system/node");
+    if(dir == NULL)
+        return;
+    while((entry = readdir(dir)) != NULL) {
+        if(sscanf(entry->d_name, "node%d", &node) != 1)
+            continue;
+        snprintf(fname, sizeof fname,
+                 "/sys/devices/system/node/%s/cpulist", entry->d_name);
+        FILE *fp = fopen(fname, "r");
+        if(fp == NULL)
+            continue;
+        if(fgets(buff, sizeof buff, fp) != NULL) {
+            // format: "0-3,8,10-11"
+            char *p = buff, *end;
+            for(;;) {
+                lo = hi = (int) strtol(p, &end, 10);
+                if(end == p)
+                    break;
+                if(*end == '-')
+                    hi = (int) strtol(end + 1, &end, 10);
+                for(i = lo; i <= hi && i < CPU_SETSIZE; ++i)
+                    nodeOf[i] = node;
+                if(*end != ',')
+                    break;
+                p = end + 1;
+            }
+        }
+        fclose(fp);
+    }
+    closedir(dir);
+}
+
+/// Give worker i the CPU cpu[i % ncpu], or unpin all if ncpu is 0.
+static void JobQueue_pin(JobQueue * jq, int ncpu, const int *cpu) {
+    int i, nodeOf[CPU_SETSIZE];
+
+    if(jq->nThreads > 0) {
+        fprintf(stderr, "%s:%s:%d: JobQueue already running\n",
+                __FILE__, __func__, __LINE__);
+        exit(1);
+    }
+    if(ncpu > 0)
+        readNodes(nodeOf);
+    for(i = 0; i < jq->nSlots; ++i) {
+        Worker *w = jq->workers + i;
+        if(ncpu == 0) {
+            w->cpu = w->node = -1;
+            continue;
+        }
+        w->cpu = cpu[i % ncpu];
+        if(w->cpu < 0 || w->cpu >= CPU_SETSIZE) {
+            fprintf(stderr, "%s:%s:%d: bad CPU number %d\n",
+                    __FILE__, __func__, __LINE__, w->cpu);
+            exit(1);
+        }
+        w->node = nodeOf[w->cpu];
+    }
+}
+
+/**
+ * Pin workers to CPUs, chosen from those on which the process is
+ * allowed to run. JOBQUEUE_COMPACT fills each NUMA node before moving
+ * to the next. JOBQUEUE_SPREAD deals workers out across nodes in
+ * turn. JOBQUEUE_UNPINNED (the default) lets workers float. If there
+ * are more workers than CPUs, CPUs are reused. A worker pins itself
+ * before it calls ThreadState_new, so that memory touched by the
+ * constructor is allocated on the worker's own node. Must be called
+ * before the first job is added.
+ */
+void JobQueue_setAffinity(JobQueue * jq, JobAffinity policy) {
+    int i, node, ncpu = 0, nnodes = 0, maxNode = 0;
+    int nodeOf[CPU_SETSIZE], cpus[CPU_SETSIZE];
+    cpu_set_t allowed;
+
+    CHECKVALID(jq);
+    if(policy == JOBQUEUE_UNPINNED) {
+        JobQueue_pin(jq, 0, NULL);
+        return;
+    }
+
+    i = sched_getaffinity(0, sizeof allowed, &allowed);
+    if(i)
+        ERR(errno, "sched_getaffinity");
+    readNodes(nodeOf);
+    for(i = 0; i < CPU_SETSIZE; ++i)
+        if(CPU_ISSET(i, &allowed) && nodeOf[i] > maxNode)
+            maxNode = nodeOf[i];
+
+    // Allowed CPUs, grouped by node, and the first index and count
+    // of each node's group.
+    int first[maxNode + 1], count[maxNode + 1];
+    for(node = 0; node <= maxNode; ++node) {
+        first[node] = ncpu;
+        for(i = 0; i < CPU_SETSIZE; ++i)
+            if(CPU_ISSET(i, &allowed) && nodeOf[i] == node)
+                cpus[ncpu++] = i;
+        count[node] = ncpu - first[node];
+        if(count[node] > 0)
+            ++nnodes;
+    }
+    assert(ncpu > 0);
+
+    if(policy == JOBQUEUE_SPREAD && nnodes > 1) {
+        int order[jq->nSlots];
+        for(i = node = 0; i < jq->nSlots; ++i) {
+            int k = i / nnodes;
+            while(count[node] == 0)
+                node = (node + 1) % (maxNode + 1);
+            order[i] = cpus[first[node] + k % count[node]];
+            node = (node + 1) % (maxNode + 1);
+        }
+        JobQueue_pin(jq, jq->nSlots, order);
+        return;
+    }
+    JobQueue_pin(jq, ncpu, cpus);
+}
+
+/**
+ * Pin worker i to CPU cpu[i % ncpu]. See JobQueue_setAffinity. Must
+ * be called before the first job is added.
+ */
+void JobQueue_setCpuList(JobQueue * jq, int ncpu, const int *cpu) {
+    CHECKVALID(jq);
+    if(ncpu <= 0 || cpu == NULL) {
+        fprintf(stderr, "%s:%s:%d: empty CPU list\n",
+                __FILE__, __func__, __LINE__);
+        exit(1);
+    }
+    JobQueue_pin(jq, ncpu, cpu);
+}
+
+/// Index of the worker running the current thread, or -1 if the
+/// current thread is not a worker.
+int JobQueue_workerIndex(void) {
+    return currWorker ? currWorker->index : -1;
+}
+
+/// NUMA node of the worker running the current thread, or -1 if
+/// the current thread is not a pinned worker.
+int JobQueue_workerNode(void) {
+    return currWorker ? currWorker->node : -1;
+}
+
+/**
+ * Time at which a job is queued, for aging and for the queue-wait
+ * histogram, or 0 if neither is in use.
+ */
+static int64_t JobQueue_stamp(JobQueue * jq) {
+    if(__atomic_load_n(&jq->stampJobs, __ATOMIC_RELAXED)
+       || __atomic_load_n(&jq->timing, __ATOMIC_RELAXED))
+        return monotonicNs();
+    return 0;
+}
+
+/// Histogram bin for a time in ns: 0 for ns <= 0, otherwise b such
+/// that 2^(b-1) <= ns < 2^b, except that the last bin has no upper
+/// limit.
+static int histBin(int64_t ns) {
+    if(ns <= 0)
+        return 0;
+    int b = 64 - __builtin_clzll((unsigned long long) ns);
+    return b < JOBQUEUE_HIST_BINS ? b : JOBQUEUE_HIST_BINS - 1;
+}
+
+/**
+ * Turn timing statistics on or off. When on, workers read the clock
+ * around each wait for jq->lock, each idle period, and each job, and
+ * jobs are stamped when queued. Counts of jobs, steals, and parks are
+ * kept in either case. Default: off. May be called at any time.
+ */
+void JobQueue_setTiming(JobQueue * jq, bool on) {
+    CHECKVALID(jq);
+    __atomic_store_n(&jq->timing, on, __ATOMIC_RELAXED);
+}
+
+/**
+ * Copy statistics into *total, summed over workers, and, if perWorker
+ * is not NULL, into perWorker[i] for each worker slot. There are as
+ * many slots as the maxThreads passed to JobQueue_new.
+ * Counters are read without stopping the workers, so a snapshot taken
+ * while jobs are running may be slightly inconsistent.
+ */
+void JobQueue_getStats(JobQueue * jq, JobStats * total,
+                       JobStats * perWorker) {
+    int i, b, status;
+
+    CHECKVALID(jq);
+    memset(total, 0, sizeof(*total));
+    for(i = 0; i < jq->nSlots; ++i) {
+        WorkerStats *ws = jq->stats + i;
+        JobStats st;
+        st.jobsRun = __atomic_load_n(&ws->jobsRun, __ATOMIC_RELAXED);
+        st.jobsStolen = __atomic_load_n(&ws->jobsStolen, __ATOMIC_RELAXED);
+        st.parks = __atomic_load_n(&ws->parks, __ATOMIC_RELAXED);
+        st.idleSeconds =
+            1e-9 * __atomic_load_n(&ws->idleNs, __ATOMIC_RELAXED);
+        st.lockSeconds =
+            1e-9 * __atomic_load_n(&ws->lockNs, __ATOMIC_RELAXED);
+        st.runSeconds = 1e-9 * __atomic_load_n(&ws->runNs, __ATOMIC_RELAXED);
+        st.queued = st.maxQueued = 0;
+        for(b = 0; b < JOBQUEUE_HIST_BINS; ++b) {
+            st.waitHist[b] =
+                __atomic_load_n(&ws->waitHist[b], __ATOMIC_RELAXED);
+            st.runHist[b] = __atomic_load_n(&ws->runHist[b], __ATOMIC_RELAXED);
+            total->waitHist[b] += st.waitHist[b];
+            total->runHist[b] += st.runHist[b];
+        }
+        total->jobsRun += st.jobsRun;
+        total->jobsStolen += st.jobsStolen;
+        total->parks += st.parks;
+        total->idleSeconds += st.idleSeconds;
+        total->lockSeconds += st.lockSeconds;
+        total->runSeconds += st.runSeconds;
+        if(perWorker)
+            perWorker[i] = st;
+    }
+
+    status = pthread_mutex_lock(&jq->lock);
+    if(status)
+        ERR(status, "lock");
+    total->queued = __atomic_load_n(&jq->nQueued, __ATOMIC_RELAXED);
+    total->maxQueued = jq->maxQueued;
+    status = pthread_mutex_unlock(&jq->lock);
+    if(status)
+        ERR(status, "unlock");
+}
+
+/// Append an event to the current thread's trace ring.
+static void JobQueue_trace(JobQueue * jq, int type, const void *job) {
+    TraceRing *ring;
+    unsigned long i;
+
+    if(currWorker != NULL && currWorker->jq == jq) {
+        ring = jq->trace + currWorker->index;
+        i = ring->head;
+        __atomic_store_n(&ring->head, i + 1, __ATOMIC_RELAXED);
+    } else {
+        ring = jq->trace + jq->nSlots;
+        i = __atomic_fetch_add(&ring->head, 1, __ATOMIC_RELAXED);
+    }
+    TraceEvent *ev = ring->ev + (i & (JOBQUEUE_TRACE_EVENTS - 1));
+    ev->t = monotonicNs();
+    ev->job = job;
+    ev->type = type;
+}
+
+/**
+ * Turn event tracing on or off. While tracing is on, each worker
+ * records when it starts and finishes each job, and when it parks and
+ * wakes, and submitting threads record when each job is queued. Each
+ * worker keeps its most recent JOBQUEUE_TRACE_EVENTS events, and
+ * threads outside the pool share one more buffer of the same size.
+ * Buffers are allocated the first time tracing is turned on. Default:
+ * off. May be called at any time.
+ */
+void JobQueue_setTracing(JobQueue * jq, bool on) {
+    int status;
+
+    CHECKVALID(jq);
+    status = pthread_mutex_lock(&jq->lock);
+    if(status)
+        ERR(status, "lock");
+    if(on && jq->trace == NULL) {
+        size_t size = (jq->nSlots + 1) * sizeof(jq->trace[0]);
+        if(posix_memalign((void **) &jq->trace, JOBQUEUE_CACHE_LINE, size))
+            jq->trace = NULL;
+        CHECKMEM(jq->trace);
+        for(int i = 0; i <= jq->nSlots; ++i)
+            jq->trace[i].head = 0;
+    }
+    __atomic_store_n(&jq->tracing, on, __ATOMIC_RELEASE);
+    status = pthread_mutex_unlock(&jq->lock);
+    if(status)
+        ERR(status, "unlock");
+}
+
+/**
+ * Write recorded trace events to fp in the Chrome trace format, which
+ * chrome://tracing and Perfetto can display. Each worker is a thread
+ * of its own; submissions from outside the pool appear on one more
+ * thread. Jobs appear as spans, linked by arrows to the events that
+ * queued them, and so do the periods workers spend parked. Call only
+ * while no jobs are running, e.g. after JobQueue_waitOnJobs.
+ */
+void JobQueue_writeTrace(JobQueue * jq, FILE * fp) {
+    int r;
+    unsigned long i, first;
+    int64_t t0 = INT64_MAX;
+    bool comma = false;
+
+    CHECKVALID(jq);
+    fprintf(fp, "{\"traceEvents\":[\n");
+    if(jq->trace == NULL) {
+        fprintf(fp, "]}\n");
+        return;
+    }
+
+    // Times are in microseconds since the earliest event kept.
+    for(r = 0; r <= jq->nSlots; ++r) {
+        TraceRing *ring = jq->trace + r;
+        unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if(head > 0) {
+            first = (head > JOBQUEUE_TRACE_EVENTS ?
+                     head - JOBQUEUE_TRACE_EVENTS : 0);
+            TraceEvent *ev = ring->ev + (first & (JOBQUEUE_TRACE_EVENTS - 1));
+            if(ev->t < t0)
+                t0 = ev->t;
+        }
+    }
+
+    for(r = 0; r <= jq->nSlots; ++r) {
+        TraceRing *ring = jq->trace + r;
+        unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+        fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\","
+                "\"pid\":0,\"tid\":%d,\"args\":{\"name\":", comma ? ",\n" : "",
+                r);
+        if(r < jq->nSlots)
+            fprintf(fp, "\"worker %d\"}}", r);
+        else
+            fprintf(fp, "\"submitters\"}}");
+        comma = true;
+
+        first = (head > JOBQUEUE_TRACE_EVENTS ?
+                 head - JOBQUEUE_TRACE_EVENTS : 0);
+        for(i = first; i < head; ++i) {
+            TraceEvent *ev = ring->ev + (i & (JOBQUEUE_TRACE_EVENTS - 1));
+            double ts = 1e-3 * (ev->t - t0);
+
+            switch (ev->type) {
+            case TRACE_ENQUEUE:
+                fprintf(fp, ",\n{\"name\":\"enqueue\",\"ph\":\"i\","
+                        "\"s\":\"t\",\"pid\":0,\"tid\":%d,\"ts\":%.3f,"
+                        "\"args\":{\"job\":\"%p\"}}", r, ts, ev->job);
+                fprintf(fp, ",\n{\"name\":\"queued\",\"cat\":\"job\","
+                        "\"ph\":\"s\",\"id\":\"%p\",\"pid\":0,"
+                        "\"tid\":%d,\"ts\":%.3f}", ev->job, r, ts);
+                break;
+            case TRACE_START:
+                fprintf(fp, ",\n{\"name\":\"queued\",\"cat\":\"job\","
+                        "\"ph\":\"f\",\"bp\":\"e\",\"id\":\"%p\","
+                        "\"pid\":0,\"tid\":%d,\"ts\":%.3f}", ev->job, r, ts);
+                fprintf(fp, ",\n{\"name\":\"job\",\"ph\":\"B\","
+                        "\"pid\":0,\"tid\":%d,\"ts\":%.3f,"
+                        "\"args\":{\"job\":\"%p\"}}", r, ts, ev->job);
+                break;
+            case TRACE_FINISH:
+                fprintf(fp, ",\n{\"name\":\"job\",\"ph\":\"E\","
+                        "\"pid\":0,\"tid\":%d,\"ts\":%.3f}", r, ts);
+                break;
+            case TRACE_PARK:
+                fprintf(fp, ",\n{\"name\":\"parked\",\"ph\":\"B\","
+                        "\"pid\":0,\"tid\":%d,\"ts\":%.3f}", r, ts);
+                break;
+            case TRACE_WAKE:
+                fprintf(fp, ",\n{\"name\":\"parked\",\"ph\":\"E\","
+                        "\"pid\":0,\"tid\":%d,\"ts\":%.3f}", r, ts);
+                break;
+            default:
+                assert(0);
+            }
+        }
+    }
+    fprintf(fp, "\n]}\n");
+}
+
+/**
+ * Choose work-stealing mode. In this mode, each worker has its own
+ * deque. A job submitted from within a running jobfun goes onto the
+ * bottom of that worker's deque, and the worker pops its own jobs
+ * from the bottom. Idle workers steal from the top of other workers'
+ * deques. Jobs submitted from outside the pool still go onto the
+ * shared queue. Must be called before the first job is added.
+ */
+void JobQueue_setWorkStealing(JobQueue * jq, bool on) {
+    int i;
+
+    CHECKVALID(jq);
+    if(jq->nThreads > 0) {
+        fprintf(stderr, "%s:%s:%d: JobQueue already running\n",
+                __FILE__, __func__, __LINE__);
+        exit(1);
+    }
+
+    jq->workStealing = on;
+    for(i = 0; i < jq->nSlots; ++i) {
+        if(on && jq->workers[i].deque == NULL)
+            jq->workers[i].deque = Deque_new(JOBQUEUE_DEQUE_SIZE);
+    }
+}
+
+/**
+ * Choose deterministic mode, in which the n'th job submitted goes to
+ * worker n modulo the pool size, and each worker runs its own jobs in
+ * the order they were submitted. Which jobs share a thread, and so a
+ * thread state, then depends only on submission order, so that a
+ * random number generator kept in ThreadState gives the same streams
+ * in every run, if ThreadState_new seeds it from JobQueue_workerIndex.
+ * Jobs submitted from several threads at once are dealt in whatever
+ * order they arrive.
+ *
+ * In this mode, all workers are launched with the first job and
+ * stay until JobQueue_free; priorities, deadlines, work stealing,
+ * inline running, and caller-helps are ignored; and the pool size
+ * cannot be changed. Must be called before the first job is added.
+ */
+void JobQueue_setDeterministic(JobQueue * jq, bool on) {
+    CHECKVALID(jq);
+    if(jq->nThreads > 0) {
+        fprintf(stderr, "%s:%s:%d: JobQueue already running\n",
+                __FILE__, __func__, __LINE__);
+        exit(1);
+    }
+    if(on && jq->pool != NULL) {
+        fprintf(stderr, "%s:%s:%d: deterministic queues can't share"
+                " a pool\n", __FILE__, __func__, __LINE__);
+        exit(1);
+    }
+    jq->deterministic = on;
+    if(on)
+        jq->maxThreads = jq->nSlots;
+}
+
+/**
+ * Report finished jobs through a file descriptor, for callers that
+ * run an event loop rather than blocking in JobQueue_waitOnJobs.
+ * Return a descriptor that becomes readable when jobs have finished;
+ * add it to an epoll, poll, or select set, and call
+ * JobQueue_completions when it fires. The descriptor is an eventfd
+ * on Linux and the read end of a pipe elsewhere. It is owned by jq
+ * and closed by JobQueue_free; don't read it directly. Now and then
+ * it fires with nothing to report.
+ *
+ * From then on, every job except the internal pieces of
+ * JobQueue_parallelFor is reported exactly once, whether it ran or
+ * was discarded. Must first be called before the first job is added;
+ * later calls return the same descriptor.
+ */
+int JobQueue_completionFd(JobQueue * jq) {
+    CHECKVALID(jq);
+    if(jq->notify)
+        return jq->notifyFd[0];
+    if(jq->nThreads > 0) {
+        fprintf(stderr, "%s:%s:%d: JobQueue already running\n",
+                __FILE__, __func__, __LINE__);
+        exit(1);
+    }
+#ifdef __linux__
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(fd < 0)
+        ERR(errno, "eventfd");
+    jq->notifyFd[0] = jq->notifyFd[1] = fd;
+#else
+    if(pipe(jq->notifyFd))
+        ERR(errno, "pipe");
+    for(int i = 0; i < 2; ++i) {
+        if(fcntl(jq->notifyFd[i], F_SETFL, O_NONBLOCK) < 0
+           || fcntl(jq->notifyFd[i], F_SETFD, FD_CLOEXEC) < 0)
+            ERR(errno, "fcntl");
+    }
+#endif
+    jq->notify = true;
+    return jq->notifyFd[0];
+}
+
+/**
+ * Copy up to max finished jobs into done, oldest first, and return
+ * the number copied, which is 0 if none has finished. Jobs added with
+ * JobQueue_addJobCopy are reported with a NULL param. Only one
+ * thread at a time may call this. The descriptor from
+ * JobQueue_completionFd stays readable while reports remain, so a
+ * caller that gets a full batch can wait for it again.
+ */
+int JobQueue_completions(JobQueue * jq, JobCompletion * done, int max) {
+    int status, n = 0;
+    Job *head = NULL, *tail = NULL;
+
+    CHECKVALID(jq);
+    if(!jq->notify)
+        return 0;
+
+    while(n < max) {
+        if(jq->doneList == NULL) {
+            // Reset the descriptor before taking the stack, so that
+            // a job pushed after we take it makes it readable again.
+            char buf[64];
+            while(read(jq->notifyFd[0], buf, sizeof buf) > 0) ;
+            Job *j = __atomic_exchange_n(&jq->doneHead, NULL,
+                                         __ATOMIC_ACQUIRE);
+            if(j == NULL)
+                break;
+            while(j != NULL) {
+                Job *next = j->next;
+                j->next = jq->doneList;
+                jq->doneList = j;
+                j = next;
+            }
+        }
+        Job *j = jq->doneList;
+        jq->doneList = j->next;
+        done[n].param = (j->param == j->data ? NULL : j->param);
+        done[n].status = j->status;
+        ++n;
+        j->next = head;
+        head = j;
+        if(tail == NULL)
+            tail = j;
+    }
+    if(jq->doneList != NULL)
+        JobQueue_notify(jq);
+
+    if(head != NULL) {
+        status = pthread_mutex_lock(&jq->poolLock);
+        if(status)
+            ERR(status, "lock poolLock");
+        tail->next = jq->freeJobs;
+        jq->freeJobs = head;
+        status = pthread_mutex_unlock(&jq->poolLock);
+        if(status)
+            ERR(status, "unlock poolLock");
+    }
+    return n;
+}
+
+/**
+ * Choose whether a thread outside the pool runs queued jobs while it
+ * waits in JobQueue_waitOnJobs, JobHandle_wait, JobGroup_wait, or
+ * JobQueue_parallelFor, rather than sleeping. Such jobs get a thread
+ * state of their own, made with ThreadState_new and kept until
+ * JobQueue_free. Jobs in workers' deques are left to the workers.
+ * The queue's own workers always help. Default: off. May be called
+ * at any time.
+ */
+void JobQueue_setCallerHelps(JobQueue * jq, bool on) {
+    CHECKVALID(jq);
+    __atomic_store_n(&jq->callerHelps, on, __ATOMIC_RELAXED);
+}
+
+/**
+ * Make JobQueue_addJob run the job at once, on the calling thread,
+ * whenever at least backlog jobs are already waiting on the shared
+ * queue. This slows producers that outrun the workers, and puts the
+ * producer's own core to work. Use backlog <= 0 to always queue,
+ * which is the default. May be called at any time.
+ */
+void JobQueue_setInlineThreshold(JobQueue * jq, long backlog) {
+    CHECKVALID(jq);
+    __atomic_store_n(&jq->inlineBacklog, backlog > 0 ? backlog : 0,
+                     __ATOMIC_RELAXED);
+}
+
+/**
+ * Reserve up to n free worker slots, without exceeding maxThreads
+ * or, in a shared pool, the threads that the pool can spare, and
+ * count them in nThreads. Call with jq->lock held. Return the number
+ * reserved; the caller must pass it to JobQueue_launch after
+ * releasing the lock.
+ */
+static int JobQueue_reserve(JobQueue * jq, long n) {
+    int i, nlaunch = 0;
+
+    if(n > jq->maxThreads - jq->nThreads)
+        n = jq->maxThreads - jq->nThreads;
+    if(n > 0 && jq->pool != NULL)
+        n = JobPool_take(jq->pool, jq, (int) n);
+    for(i = 0; i < jq->nSlots && n > 0; ++i) {
+        Worker *w = jq->workers + i;
+        if(__atomic_load_n(&w->state, __ATOMIC_RELAXED) != WORKER_FREE)
+            continue;
+        __atomic_store_n(&w->state, WORKER_RESERVED, __ATOMIC_RELAXED);
+        if(i >= jq->hiSlot)
+            __atomic_store_n(&jq->hiSlot, i + 1, __ATOMIC_RELEASE);
+        ++nlaunch;
+        --n;
+    }
+    assert(n <= 0);             // slots in use == nThreads
+    if(nlaunch > 0)
+        __atomic_add_fetch(&jq->nThreads, nlaunch, __ATOMIC_SEQ_CST);
+    return nlaunch;
+}
+
+/**
+ * Make sure that someone will run njobs newly queued jobs: wake up to
+ * njobs idle workers, and if that isn't enough, reserve slots for new
+ * workers until the pool is full. Call with jq->lock held. Return
+ * the number of slots reserved; the caller must pass it to
+ * JobQueue_launch after releasing the lock.
+ */
+static int JobQueue_wake(JobQueue * jq, long njobs) {
+    int status;
+    int spinning = __atomic_load_n(&jq->spinning, __ATOMIC_RELAXED);
+    int parked = jq->idle - spinning;
+
+    // Dealing a job wakes its worker, and every worker may be dealt
+    // one.
+    if(jq->deterministic)
+        return JobQueue_reserve(jq, jq->nSlots);
+
+    // Spinning workers will find work without being told.
+    njobs -= spinning;
+
+    // If threads are parked, wake as many as we need
+    if(parked > 0 && njobs > 0) {
+        if(njobs >= parked) {
+            status = pthread_cond_broadcast(&jq->wakeWorker);
+            if(status)
+                ERR(status, "broadcast wakeWorker");
+        } else {
+            for(long i = 0; i < njobs; ++i) {
+                status = pthread_cond_signal(&jq->wakeWorker);
+                if(status)
+                    ERR(status, "signal wakeWorker");
+            }
+        }
+    }
+    njobs -= parked;
+
+    return JobQueue_reserve(jq, njobs);
+}
+
+/**
+ * Start n workers in slots reserved by JobQueue_reserve. Called
+ * without holding jq->lock, so that other submitters don't wait while
+ * threads are created. Concurrent launchers may start each other's
+ * slots, but each starts as many as it reserved. A slot whose
+ * previous thread retired is joined before it is reused. In a shared
+ * pool, a queue still waiting for threads wakes other members' idle
+ * workers, so that they make room.
+ */
+static void JobQueue_launch(JobQueue * jq, int n) {
+    int i, status;
+
+    if(jq->pool != NULL && __atomic_load_n(&jq->poolWaiting,
+                                           __ATOMIC_SEQ_CST))
+        JobPool_kick(jq->pool, jq);
+
+    for(i = 0; n > 0 && i < jq->nSlots; ++i) {
+        Worker *w = jq->workers + i;
+        int expect = WORKER_RESERVED;
+        if(!__atomic_compare_exchange_n(&w->state, &expect, WORKER_RUNNING,
+                                        false, __ATOMIC_ACQUIRE,
+                                        __ATOMIC_RELAXED))
+            continue;
+        --n;
+        if(w->launched) {
+            // A worker that has left may be passing its pool slot
+            // back to its own queue. It can't join itself, so its
+            // successor joins it.
+            if(pthread_equal(w->thread, pthread_self())) {
+                w->prev = w->thread;
+                w->joinPrev = true;
+            } else {
+                status = pthread_join(w->thread, NULL);
+                if(status)
+                    ERR(status, "pthread_join");
+            }
+            __atomic_store_n(&w->launched, false, __ATOMIC_RELAXED);
+        }
+        status = pthread_create(&w->thread, &jq->attr, threadfun,
+                                (void *) w);
+        if(status) {
+            fprintf(stderr, "%s:%d: pthread_create returned %d (%s)\n",
+                    __func__, __LINE__, status, strerror(status));
+            exit(1);
+        }
+        // The new thread waits for this before doing anything.
+        __atomic_store_n(&w->launched, true, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * Launch maxThreads workers now, rather than as jobs arrive, and
+ * wait until each has run ThreadState_new. The first batch of jobs
+ * then pays no thread-creation or state-construction cost. Options
+ * that must be set before the first job, such as work-stealing mode,
+ * must also be set before this call. A member of a shared pool gets
+ * only as many workers as the pool can spare.
+ */
+void JobQueue_prespawn(JobQueue * jq) {
+    int status, nlaunch;
+
+    CHECKVALID(jq);
+    status = pthread_mutex_lock(&jq->lock);
+    if(status)
+        ERR(status, "lock");
+    nlaunch = JobQueue_reserve(jq, jq->maxThreads);
+    status = pthread_mutex_unlock(&jq->lock);
+    if(status)
+        ERR(status, "unlock");
+
+    JobQueue_launch(jq, nlaunch);
+
+    status = pthread_mutex_lock(&jq->lock);
+    if(status)
+        ERR(status, "lock");
+    while(jq->nReady < jq->nThreads) {
+        status = pthread_cond_wait(&jq->wakeMain, &jq->lock);
+        if(status)
+            ERR(status, "wait wakeMain");
+    }
+    status = pthread_mutex_unlock(&jq->lock);
+    if(status)
+        ERR(status, "unlock");
+}
+
+/**
+ * Set the most threads the pool may run, from 1 to the maxThreads
+ * passed to JobQueue_new. Workers above a lowered limit leave as
+ * soon as they finish their current jobs, and free their thread
+ * states. May be called at any time.
+ */
+void JobQueue_setMaxThreads(JobQueue * jq, int n) {
+    int status;
+
+    CHECKVALID(jq);
+    if(n < 1 || n > jq->nSlots) {
+        fprintf(stderr, "%s:%s:%d: bad thread count: %d\n",
+                __FILE__, __func__, __LINE__, n);
+        exit(1);
+    }
+    if(jq->deterministic) {
+        fprintf(stderr, "%s:%s:%d: pool size is fixed in deterministic"
+                " mode\n", __FILE__, __func__, __LINE__);
+        exit(1);
+    }
+    status = pthread_mutex_lock(&jq->lock);
+    if(status)
+        ERR(status, "lock");
+    __atomic_store_n(&jq->maxThreads, n, __ATOMIC_RELAXED);
+    if(jq->nThreads > n && jq->idle > 0) {
+        status = pthread_cond_broadcast(&jq->wakeWorker);
+        if(status)
+            ERR(status, "broadcast wakeWorker");
+    }
+    status = pthread_mutex_unlock(&jq->lock);
+    if(status)
+        ERR(status, "unlock");
+}
+
+/**
+ * Let workers that have been idle for the given number of seconds
+ * exit and free their thread states, as long as at least minThreads
+ * remain. New workers are launched as the queue grows again, up to
+ * maxThreads. Use seconds <= 0 to keep workers until JobQueue_free,
+ * which is the default. May be called at any time.
+ */
+void JobQueue_setIdleTimeout(JobQueue * jq, double seconds,
+                             int minThreads) {
+    int status;
+
+    CHECKVALID(jq);
+    if(minThreads < 0) {
+        fprintf(stderr, "%s:%s:%d: bad thread count: %d\n",
+                __FILE__, __func__, __LINE__, minThreads);
+        exit(1);
+    }
+    status = pthread_mutex_lock(&jq->lock);
+    if(status)
+        ERR(status, "lock");
+    jq->minThreads = minThreads;
+    jq->idleNs = (seconds > 0.0 ? (int64_t) (seconds * 1e9) : 0);
+    if(jq->idle > 0) {
+        // Parked workers start their timeouts over.
+        status = pthread_cond_broadcast(&jq->wakeWorker);
+        if(status)
+            ERR(status, "broadcast wakeWorker");
+    }
+    status = pthread_mutex_unlock(&jq->lock);
+    if(status)
+        ERR(status, "unlock");
+}
+
+/// Return the number of worker threads now running or starting.
+int JobQueue_threadCount(JobQueue * jq) {
+    CHECKVALID(jq);
+    return __atomic_load_n(&jq->nThreads, __ATOMIC_RELAXED);
+}
+
+/**
+ * Put a filled-in job on the queue and make sure someone will run
+ * it. In work-stealing mode, a job of default priority submitted by
+ * one of our own workers goes onto that worker's deque. Other jobs of
+ * default priority go into the inbox. Neither path locks unless a
+ * worker must be woken or launched. Jobs with a priority or deadline
+ * go onto the shared queue under the lock.
+ */
+static void JobQueue_push(JobQueue * jq, Job * job) {
+    int status, nlaunch;
+    bool plain = (job->priority == 0 && job->deadline == 0
+                  && !jq->deterministic);
+
+    TRACE(jq, TRACE_ENQUEUE, job);
+
+    if(plain && jq->workStealing && currWorker != NULL
+       && currWorker->jq == jq && Deque_push(currWorker->deque, job)) {
+
+        // This fence pairs with the one implied by incrementing
+        // jq->idle in threadfun: either we see the idle worker, or
+        // it sees our job when it scans the deques.
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    } else if(plain) {
+        // Incrementing nQueued is the fence here, and an idle
+        // worker checks nQueued after counting itself idle.
+        JobQueue_inboxPush(jq, job);
+        __atomic_add_fetch(&jq->nQueued, 1, __ATOMIC_SEQ_CST);
+    } else {
+        status = pthread_mutex_lock(&jq->lock);
+        if(status)
+            ERR(status, "lock");
+
+        JobQueue_enqueue(jq, job, job, 1);
+
+        nlaunch = JobQueue_wake(jq, 1);
+
+        status = pthread_mutex_unlock(&jq->lock);
+        if(status)
+            ERR(status, "unlock");
+        JobQueue_launch(jq, nlaunch);
+        return;
+    }
+
+    // Lock only if someone needs waking or launching. A spinning
+    // worker finds the job on its own, both while it spins and
+    // after it stops.
+    if(__atomic_load_n(&jq->nThreads, __ATOMIC_RELAXED)
+       == __atomic_load_n(&jq->maxThreads, __ATOMIC_RELAXED)
+       && (__atomic_load_n(&jq->idle, __ATOMIC_RELAXED) == 0
+           || __atomic_load_n(&jq->spinning, __ATOMIC_RELAXED) > 0))
+        return;
+
+    status = pthread_mutex_lock(&jq->lock);
+    if(status)
+        ERR(status, "lock");
+    nlaunch = JobQueue_wake(jq, 1);
+    status = pthread_mutex_unlock(&jq->lock);
+    if(status)
+        ERR(status, "unlock");
+    JobQueue_launch(jq, nlaunch);
+}
+
+/**
+ * In bounded mode, make sure there is room on the shared queue. A
+ * submitter that finds the queue full waits until workers have
+ * drained it to the low-water mark. deadline is a monotonic time in
+ * ns; 0 means wait as long as it takes, and -1 means don't wait.
+ * Workers of this queue never wait, since they might be the ones
+ * that would have to drain it. Return true if there is room. A
+ * submitter still waiting when JobQueue_noMoreJobs is called fails
+ * as it would have, had it called after.
+ */
+static bool JobQueue_waitForRoom(JobQueue * jq, int64_t deadline) {
+    int status;
+    long cap = __atomic_load_n(&jq->capacity, __ATOMIC_RELAXED);
+    bool room = true;
+
+    if(cap == 0 || __atomic_load_n(&jq->nQueued, __ATOMIC_RELAXED) < cap)
+        return true;
+    if(deadline < 0 || (currWorker != NULL && currWorker->jq == jq))
+        return false;
+
+    status = pthread_mutex_lock(&jq->lock);
+    if(status)
+        ERR(status, "lock");
+    ++jq->nBlocked;
+    while(jq->capacity > 0 && jq->acceptingJobs
+          && __atomic_load_n(&jq->nQueued, __ATOMIC_RELAXED) > jq->lowWater) {
+        if(deadline == 0) {
+            status = pthread_cond_wait(&jq->wakeSubmitter, &jq->lock);
+        } else {
+            struct timespec ts = {.tv_sec = deadline / 1000000000LL,
+                .tv_nsec = deadline % 1000000000LL
+            };
+            status = pthread_cond_timedwait(&jq->wakeSubmitter, &jq->lock,
+                                            &ts);
+            if(status == ETIMEDOUT) {
+                room = false;
+                break;
+            }
+        }
+        if(status)
+            ERR(status, "wait wakeSubmitter");
+    }
+    --jq->nBlocked;
+    bool accepting = jq->acceptingJobs;
+    status = pthread_mutex_unlock(&jq->lock);
+    if(status)
+        ERR(status, "unlock");
+    if(!accepting) {
+        fprintf(stderr, "%s:%s:%d: JobQueue not accepting jobs\n",
+                __FILE__, __func__, __LINE__);
+        exit(1);
+    }
+    return room;
+}
+
+/**
+ * Add a job of default priority, waiting for room on a bounded queue
+ * as JobQueue_waitForRoom does. Return 0, or EAGAIN or ETIMEDOUT if
+ * there was no room in time. A worker that finds the queue full runs
+ * the job itself, with or without a timeout, unless it asked not to
+ * wait at all. If data is not NULL, its size bytes are copied into
+ * the node, and param is ignored. Likewise if mv is not NULL, except
+ * that mv->move does the copying.
+ */
+static int JobQueue_add(JobQueue * jq, int (*jobfun) (void *, void *),
+                        void *param, const void *data, size_t size,
+                        const JobMove * mv, int64_t deadline) {
+    bool here = false;
+    assert(jq);
+
+    if(jq->valid != JOBQUEUE_VALID) {
+        fprintf(stderr, "%s:%d: JobQueue not initialized", __func__,
+                __LINE__);
+        exit(1);
+    }
+
+    if(!jq->acceptingJobs) {
+        fprintf(stderr, "%s:%s:%d: JobQueue not accepting jobs\n",
+                __FILE__, __func__, __LINE__);
+        exit(1);
+    }
+
+    if(!JobQueue_waitForRoom(jq, deadline)) {
+        if(deadline < 0)
+            return EAGAIN;
+        if(deadline > 0 && (currWorker == NULL || currWorker->jq != jq))
+            return ETIMEDOUT;
+        here = true;
+    }
+
+    Job *job = Job_alloc(jq);
+    Job_init(job, jobfun, param);
+    if(data != NULL) {
+        memcpy(job->data, data, size);
+        job->param = job->data;
+    } else if(mv != NULL) {
+        mv->move(job->data, mv->src);
+        job->drop = mv->drop;
+        job->moved = true;
+        job->param = job->data;
+    }
+
+    // Jobs run here would escape deterministic dealing.
+    long backlog = __atomic_load_n(&jq->inlineBacklog, __ATOMIC_RELAXED);
+    if(!jq->deterministic
+       && (here || (backlog > 0
+                    && __atomic_load_n(&jq->nQueued,
+                                       __ATOMIC_RELAXED) >= backlog))) {
+        JobQueue_runHere(jq, job);
+        return 0;
+    }
+
+    job->enqueued = JobQueue_stamp(jq);
+    JobQueue_push(jq, job);
+    return 0;
+}
+
+/**
+ * Add a job. On a bounded queue that is full, wait for room; see
+ * JobQueue_setCapacity.
+ */
+void JobQueue_addJob(JobQueue * jq, int (*jobfun) (void *, void *),
+                     void *param) {
+    JobQueue_add(jq, jobfun, param, NULL, 0, NULL, 0);
+}
+
+/**
+ * Add a job whose parameter is copied into the job itself, so that
+ * the caller need not keep it alive. data points to size bytes, at
+ * most JOBQUEUE_INLINE_BYTES. jobfun gets a pointer to the copy,
+ * which lasts until jobfun returns. Otherwise like JobQueue_addJob.
+ */
+void JobQueue_addJobCopy(JobQueue * jq, int (*jobfun) (void *, void *),
+                         const void *data, size_t size) {
+    if(size > JOBQUEUE_INLINE_BYTES) {
+        fprintf(stderr, "%s:%s:%d: %zu bytes won't fit in a job;"
+                " max is %d\n", __FILE__, __func__, __LINE__, size,
+                JOBQUEUE_INLINE_BYTES);
+        exit(1);
+    }
+    JobQueue_add(jq, jobfun, NULL, data, size, NULL, 0);
+}
+
+/**
+ * Add a job whose parameter is moved into the job by calling
+ * move(dst, data), where dst points to at most JOBQUEUE_MOVE_BYTES,
+ * aligned to JOBQUEUE_INLINE_ALIGN. This suits objects that can't
+ * simply be copied byte for byte. jobfun gets dst and must destroy
+ * the object before returning. If the job is discarded without being
+ * run, drop(dst) destroys it instead. Otherwise like JobQueue_addJob.
+ */
+void JobQueue_addJobMove(JobQueue * jq, int (*jobfun) (void *, void *),
+                         void *data, size_t size,
+                         void (*move) (void *dst, void *src),
+                         void (*drop) (void *param)) {
+    if(size > JOBQUEUE_MOVE_BYTES) {
+        fprintf(stderr, "%s:%s:%d: %zu bytes won't fit in a job;"
+                " max is %d\n", __FILE__, __func__, __LINE__, size,
+                JOBQUEUE_MOVE_BYTES);
+        exit(1);
+    }
+    JobMove mv = {.src = data,.move = move,.drop = drop };
+    JobQueue_add(jq, jobfun, NULL, NULL, size, &mv, 0);
+}
+
+/**
+ * Add a job, waiting at most timeout seconds for room on a bounded
+ * queue. Return 0 on success, or ETIMEDOUT if the job was not added.
+ * A worker of this queue doesn't wait: if the queue is full, it runs
+ * the job on the spot, as JobQueue_addJob does, and returns 0.
+ */
+int JobQueue_addJobTimed(JobQueue * jq, int (*jobfun) (void *, void *),
+                         void *param, double timeout) {
+    int64_t deadline = -1;
+    if(timeout > 0.0)
+        deadline = monotonicNs() + (int64_t) (timeout * 1e9);
+    int status = JobQueue_add(jq, jobfun, param, NULL, 0, NULL, deadline);
+    return (status == EAGAIN ? ETIMEDOUT : status);
+}
+
+/// Add a job if a bounded queue has room. Return false if it didn't.
+bool JobQueue_tryAddJob(JobQueue * jq, int (*jobfun) (void *, void *),
+                        void *param) {
+    return JobQueue_add(jq, jobfun, param, NULL, 0, NULL, -1) == 0;
+}
+
+/**
+ * Bound the shared queue at capacity jobs, or use capacity <= 0 for
+ * no bound, which is the default. Once the queue is full,
+ * JobQueue_addJob, JobQueue_addJobCopy, JobQueue_addJobMove,
+ * JobQueue_addJobPriority, JobQueue_addJobCancelable,
+ * JobQueue_addJobs, JobQueue_submit, and JobGroup_add wait until
+ * workers have brought it down to lowWater jobs, which must be less
+ * than capacity; JobQueue_tryAddJob and JobQueue_addJobTimed give up
+ * instead. A batch from JobQueue_addJobs is admitted in chunks no
+ * larger than the room left, so the bound holds for batches too.
+ * Workers never wait: when one of them finds the queue full,
+ * JobQueue_addJob, JobQueue_addJobCopy, JobQueue_addJobMove, and
+ * JobQueue_addJobTimed run the job on the spot, JobQueue_tryAddJob
+ * fails, and the other calls add the job anyway.
+ * JobQueue_addJobAfter and JobHandle_then are not bounded, even for
+ * jobs that are ready at once, and neither are jobs that become
+ * ready when their predecessors finish. May be called at any time.
+ */
+void JobQueue_setCapacity(JobQueue * jq, long capacity, long lowWater) {
+    int status;
+
+    CHECKVALID(jq);
+    if(capacity < 0)
+        capacity = 0;
+    if(capacity > 0 && (lowWater < 0 || lowWater >= capacity)) {
+        fprintf(stderr, "%s:%s:%d: bad low-water mark: %ld\n",
+                __FILE__, __func__, __LINE__, lowWater);
+        exit(1);
+    }
+    status = pthread_mutex_lock(&jq->lock);
+    if(status)
+        ERR(status, "lock");
+    jq->lowWater = (capacity > 0 ? lowWater : 0);
+    __atomic_store_n(&jq->capacity, capacity, __ATOMIC_RELAXED);
+    status = pthread_cond_broadcast(&jq->wakeSubmitter);
+    if(status)
+        ERR(status, "broadcast wakeSubmitter");
+    status = pthread_mutex_unlock(&jq->lock);
+    if(status)
+        ERR(status, "unlock");
+}
+
+/**
+ * Add a job with a given priority, from 0 (the default, and lowest)
+ * to JOBQUEUE_NPRIORITY-1 (the highest), and an optional soft
+ * deadline, in seconds from now. Use deadline <= 0 for no deadline.
+ *
+ * Workers take the highest-priority job first, except that a job
+ * whose deadline is less than a millisecond away, or already past,
+ * is taken before any other. A deadline is soft: a late job still
+ * runs. To keep low-priority jobs from starving, jobs gain priority
+ * as they wait (see JobQueue_setAging).
+ */
+void JobQueue_addJobPriority(JobQueue * jq, int (*jobfun) (void *, void *),
+                             void *param, int priority, double deadline) {
+    assert(jq);
+    CHECKVALID(jq);
+
+    if(!jq->acceptingJobs) {
+        fprintf(stderr, "%s:%s:%d: JobQueue not accepting jobs\n",
+                __FILE__, __func__, __LINE__);
+        exit(1);
+    }
+
+    if(priority < 0 || priority >= JOBQUEUE_NPRIORITY) {
+        fprintf(stderr, "%s:%s:%d: bad priority: %d\n",
+                __FILE__, __func__, __LINE__, priority);
+        exit(1);
+    }
+
+    JobQueue_waitForRoom(jq, 0);
+
+    int64_t now = monotonicNs();
+    if(!__atomic_load_n(&jq->stampJobs, __ATOMIC_ACQUIRE)
+       && (priority > 0 || deadline > 0.0)) {
+        int status = pthread_mutex_lock(&jq->lock);
+        if(status)
+            ERR(status, "lock");
+        if(!jq->stampJobs) {
+            jq->agingEpoch = now;
+            __atomic_store_n(&jq->stampJobs, true, __ATOMIC_RELEASE);
+        }
+        status = pthread_mutex_unlock(&jq->lock);
+        if(status)
+            ERR(status, "unlock");
+    }
+
+    Job *job = Job_alloc(jq);
+    Job_init(job, jobfun, param);
+    job->priority = priority;
+    job->enqueued = now;
+    if(deadline > 0.0)
+        job->deadline = now + (int64_t) (deadline * 1e9);
+    JobQueue_push(jq, job);
+}
+
+/**
+ * Set the aging interval, in seconds: a queued job gains one level
+ * of priority for each interval it waits. The default is 0.01. Use 0
+ * to turn aging off.
+ */
+void JobQueue_setAging(JobQueue * jq, double seconds) {
+    int status;
+
+    CHECKVALID(jq);
+    status = pthread_mutex_lock(&jq->lock);
+    if(status)
+        ERR(status, "lock");
+    jq->agingNs = (seconds > 0.0 ? (int64_t) (seconds * 1e9) : 0);
+    status = pthread_mutex_unlock(&jq->lock);
+    if(status)
+        ERR(status, "unlock");
+}
+
+/**
+ * Set how long an idle worker spins, looking for work, before it
+ * parks on a condition variable. Parking and waking cost a system
+ * call and a context switch, which dominate when jobs arrive in
+ * short bursts. A worker that spins in vain spins half as long the
+ * next time, and returns to the full limit when a spin finds
+ * work. After spinning, a worker yields the processor a few times
+ * before it parks. On a single processor there is no spin phase, only
+ * the yields. Zero disables both. Default: JOBQUEUE_SPIN_NS. May be
+ * called at any time.
+ */
+void JobQueue_setSpin(JobQueue * jq, double seconds) {
+    CHECKVALID(jq);
+    __atomic_store_n(&jq->spinNs,
+                     (seconds > 0.0 ? (int64_t) (seconds * 1e9) : 0),
+                     __ATOMIC_RELAXED);
+}
+
+/**
+ * Put into len[i] the number of jobs of priority i that are waiting
+ * in the shared queue, including those with deadlines. Jobs on the
+ * deques of work-stealing mode are not counted.
+ */
+void JobQueue_queueLengths(JobQueue * jq, long len[JOBQUEUE_NPRIORITY]) {
+    int i, status;
+
+    CHECKVALID(jq);
+    status = pthread_mutex_lock(&jq->lock);
+    if(status)
+        ERR(status, "lock");
+    JobQueue_drain(jq);
+    for(i = 0; i < JOBQUEUE_NPRIORITY; ++i)
+        len[i] = jq->todo[i].len + jq->heapLenByPriority[i];
+    status = pthread_mutex_unlock(&jq->lock);
+    if(status)
+        ERR(status, "unlock");
+}
+
+static JobHandle *JobHandle_new(JobQueue * jq) {
+    int status;
+    JobHandle *h = malloc(sizeof(JobHandle));
+    CHECKMEM(h);
+
+    h->jq = jq;
+    h->refs = 2;
+    h->done = false;
+    h->status = 0;
+    h->then = NULL;
+    if((status = pthread_mutex_init(&h->lock, NULL)))
+        ERR(status, "mutex_init");
+    if((status = pthread_cond_init(&h->finished, NULL)))
+        ERR(status, "cond_init");
+    return h;
+}
+
+/// Drop one reference, and free the handle when none remain.
+static void JobHandle_release(JobHandle * h) {
+    int status;
+
+    if(__atomic_sub_fetch(&h->refs, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    status = pthread_mutex_destroy(&h->lock);
+    if(status)
+        ERR(status, "destroy lock");
+    status = pthread_cond_destroy(&h->finished);
+    if(status)
+        ERR(status, "destroy finished");
+    free(h);
+}
+
+/**
+ * Record the job's result, wake only the threads waiting on this
+ * handle, and queue any jobs chained to it. Drops the job's
+ * reference.
+ */
+static void JobHandle_finish(JobHandle * h, int status) {
+    int s;
+    JobEdge *e, *next;
+
+    s = pthread_mutex_lock(&h->lock);
+    if(s)
+        ERR(s, "lock");
+    h->status = status;
+    __atomic_store_n(&h->done, true, __ATOMIC_RELEASE);
+    e = h->then;
+    h->then = NULL;
+    s = pthread_cond_broadcast(&h->finished);
+    if(s)
+        ERR(s, "broadcast finished");
+    s = pthread_mutex_unlock(&h->lock);
+    if(s)
+        ERR(s, "unlock");
+
+    for(; e != NULL; e = next) {
+        next = e->next;
+        Job_predDone(h->jq, e->job);
+        free(e);
+    }
+    JobHandle_release(h);
+}
+
+/**
+ * One of the job's predecessors has finished. Queue the job if it
+ * was the last.
+ */
+static void Job_predDone(JobQueue * jq, Job * job) {
+    if(__atomic_sub_fetch(&job->npred, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    job->enqueued = JobQueue_stamp(jq);
+    JobQueue_push(jq, job);
+}
+
+/**
+ * Add a job and return a handle that can be waited on, polled, or
+ * chained. The caller must eventually release the handle with
+ * JobHandle_free, whether or not the job has finished.
+ */
+JobHandle *JobQueue_submit(JobQueue * jq, int (*jobfun) (void *, void *),
+                           void *param) {
+    assert(jq);
+    CHECKVALID(jq);
+
+    if(!jq->acceptingJobs) {
+        fprintf(stderr, "%s:%s:%d: JobQueue not accepting jobs\n",
+                __FILE__, __func__, __LINE__);
+        exit(1);
+    }
+
+    JobQueue_waitForRoom(jq, 0);
+
+    Job *job = Job_alloc(jq);
+    Job_init(job, jobfun, param);
+    job->enqueued = JobQueue_stamp(jq);
+    job->handle = JobHandle_new(jq);
+    JobHandle *h = job->handle;
+    JobQueue_push(jq, job);
+    return h;
+}
+
+/**
+ * Wait until the job has finished, and return the value of jobfun.
+ * A waiting worker, or a caller in caller-helps mode, runs other jobs
+ * meanwhile, so jobs may wait for the jobs they submit.
+ */
+int JobHandle_wait(JobHandle * h) {
+    int status, rval;
+
+    if(__atomic_load_n(&h->done, __ATOMIC_ACQUIRE))
+        return h->status;
+
+    bool helps = JobQueue_helps(h->jq);
+    while(helps && !__atomic_load_n(&h->done, __ATOMIC_ACQUIRE)) {
+        if(JobQueue_help(h->jq))
+            continue;
+        status = pthread_mutex_lock(&h->lock);
+        if(status)
+            ERR(status, "lock");
+        if(!h->done)
+            condNap(&h->finished, &h->lock);
+        status = pthread_mutex_unlock(&h->lock);
+        if(status)
+            ERR(status, "unlock");
+    }
+
+    status = pthread_mutex_lock(&h->lock);
+    if(status)
+        ERR(status, "lock");
+    while(!h->done) {
+        status = pthread_cond_wait(&h->finished, &h->lock);
+        if(status)
+            ERR(status, "wait finished");
+    }
+    rval = h->status;
+    status = pthread_mutex_unlock(&h->lock);
+    if(status)
+        ERR(status, "unlock");
+    return rval;
+}
+
+/**
+ * Return true if the job has finished, without waiting. If so, and
+ * if status is not NULL, put the value of jobfun into *status.
+ */
+bool JobHandle_poll(JobHandle * h, int *status) {
+    if(!__atomic_load_n(&h->done, __ATOMIC_ACQUIRE))
+        return false;
+    if(status != NULL)
+        *status = h->status;
+    return true;
+}
+
+/**
+ * Chain a job onto h: it is queued on the same JobQueue once h's job
+ * finishes, or at once if h's job has already finished. Return a
+ * handle for the new job, which the caller must release with
+ * JobHandle_free.
+ */
+JobHandle *JobHandle_then(JobHandle * h, int (*jobfun) (void *, void *),
+                          void *param) {
+    return JobQueue_addJobAfter(h->jq, jobfun, param, &h, 1);
+}
+
+/**
+ * Add a job that will not be queued until each of the ndeps jobs
+ * in deps has finished, successfully or not. NULL entries in deps
+ * are ignored. Return a handle for the new job, which may itself be
+ * passed as a dependency of later jobs, so that a whole DAG can be
+ * submitted at once. The caller must release it with
+ * JobHandle_free.
+ */
+JobHandle *JobQueue_addJobAfter(JobQueue * jq,
+                                int (*jobfun) (void *, void *),
+                                void *param, JobHandle ** deps,
+                                int ndeps) {
+    int i, status;
+    assert(jq);
+    CHECKVALID(jq);
+
+    if(!jq->acceptingJobs) {
+        fprintf(stderr, "%s:%s:%d: JobQueue not accepting jobs\n",
+                __FILE__, __func__, __LINE__);
+        exit(1);
+    }
+
+    Job *job = Job_alloc(jq);
+    Job_init(job, jobfun, param);
+    job->handle = JobHandle_new(jq);
+    JobHandle *h = job->handle;
+
+    // The extra count is ours. It keeps the job off the queue until
+    // every edge is in place.
+    job->npred = ndeps + 1;
+    for(i = 0; i < ndeps; ++i) {
+        JobHandle *dep = deps[i];
+        bool done = true;
+
+        if(dep != NULL) {
+            if(dep->jq != jq) {
+                fprintf(stderr, "%s:%s:%d: dependency belongs to"
+                        " another JobQueue\n", __FILE__, __func__,
+                        __LINE__);
+                exit(1);
+            }
+            JobEdge *e = malloc(sizeof(JobEdge));
+            CHECKMEM(e);
+            e->job = job;
+
+            status = pthread_mutex_lock(&dep->lock);
+            if(status)
+                ERR(status, "lock");
+            done = dep->done;
+            if(!done) {
+                e->next = dep->then;
+                dep->then = e;
+            }
+            status = pthread_mutex_unlock(&dep->lock);
+            if(status)
+                ERR(status, "unlock");
+            if(done)
+                free(e);
+        }
+        if(done)
+            Job_predDone(jq, job);
+    }
+    Job_predDone(jq, job);
+    return h;
+}
+
+/// Release the caller's reference to a handle.
+void JobHandle_free(JobHandle * h) {
+    if(h != NULL)
+        JobHandle_release(h);
+}
+
+/**
+ * Set a function to be called, in the worker's thread, each time a
+ * job returns nonzero: onError(errData, status, param), where param
+ * is the failed job's param. Calls from different workers may
+ * overlap.
+ */
+void JobQueue_setErrorCallback(JobQueue * jq,
+                               void (*onError) (void *errData, int status,
+                                                void *param),
+                               void *errData) {
+    CHECKVALID(jq);
+    if(jq->nThreads > 0) {
+        fprintf(stderr, "%s:%s:%d: JobQueue already running\n",
+                __FILE__, __func__, __LINE__);
+        exit(1);
+    }
+    jq->onError = onError;
+    jq->errData = errData;
+}
+
+/**
+ * Choose cancel-on-error mode. In this mode, the first job to return
+ * nonzero causes all queued jobs to be discarded, and later jobs are
+ * discarded too, rather than run, until JobQueue_clearErrors is
+ * called. Discarded jobs finish their handles with status ECANCELED.
+ * Must be called before the first job is added.
+ */
+void JobQueue_setCancelOnError(JobQueue * jq, bool on) {
+    CHECKVALID(jq);
+    if(jq->nThreads > 0) {
+        fprintf(stderr, "%s:%s:%d: JobQueue already running\n",
+                __FILE__, __func__, __LINE__);
+        exit(1);
+    }
+    jq->cancelOnError = on;
+}
+
+/// Number of jobs that have returned nonzero.
+long JobQueue_errorCount(JobQueue * jq) {
+    CHECKVALID(jq);
+    return __atomic_load_n(&jq->nErrors, __ATOMIC_RELAXED);
+}
+
+/// Status returned by the first job that failed, or 0 if none has.
+int JobQueue_firstError(JobQueue * jq) {
+    CHECKVALID(jq);
+    return __atomic_load_n(&jq->firstError, __ATOMIC_RELAXED);
+}
+
+/// Number of jobs discarded without running: in cancel-on-error mode,
+/// or because they were cancelled or expired.
+long JobQueue_discardCount(JobQueue * jq) {
+    CHECKVALID(jq);
+    return __atomic_load_n(&jq->nDiscarded, __ATOMIC_RELAXED);
+}
+
+/**
+ * Reset the error and discard counts. In cancel-on-error mode, jobs
+ * added after this call will run.
+ */
+void JobQueue_clearErrors(JobQueue * jq) {
+    CHECKVALID(jq);
+    __atomic_store_n(&jq->firstError, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&jq->nDiscarded, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&jq->nErrors, 0, __ATOMIC_SEQ_CST);
+}
+
+/// Create an empty group of jobs, to be run by jq.
+JobGroup *JobGroup_new(JobQueue * jq) {
+    int status;
+
+    CHECKVALID(jq);
+    JobGroup *g = malloc(sizeof(JobGroup));
+    CHECKMEM(g);
+
+    g->jq = jq;
+    g->refs = 1;
+    g->outstanding = 0;
+    g->nErrors = 0;
+    g->firstError = 0;
+    if((status = pthread_mutex_init(&g->lock, NULL)))
+        ERR(status, "mutex_init");
+    if((status = pthread_cond_init(&g->finished, NULL)))
+        ERR(status, "cond_init");
+    return g;
+}
+
+/// Drop one reference, and free the group when none remain.
+static void JobGroup_release(JobGroup * g) {
+    int status;
+
+    if(__atomic_sub_fetch(&g->refs, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    status = pthread_mutex_destroy(&g->lock);
+    if(status)
+        ERR(status, "destroy lock");
+    status = pthread_cond_destroy(&g->finished);
+    if(status)
+        ERR(status, "destroy finished");
+    free(g);
+}
+
+/**
+ * Record that one of the group's jobs has finished. Only the last
+ * one takes the group's lock, to wake waiters. Drops the job's
+ * reference.
+ */
+static void JobGroup_finish(JobGroup * g, int status) {
+    int s, zero = 0;
+
+    if(status != 0) {
+        __atomic_compare_exchange_n(&g->firstError, &zero, status, false,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&g->nErrors, 1, __ATOMIC_RELAXED);
+    }
+
+    if(__atomic_sub_fetch(&g->outstanding, 1, __ATOMIC_ACQ_REL) == 0) {
+        s = pthread_mutex_lock(&g->lock);
+        if(s)
+            ERR(s, "lock");
+        s = pthread_cond_broadcast(&g->finished);
+        if(s)
+            ERR(s, "broadcast finished");
+        s = pthread_mutex_unlock(&g->lock);
+        if(s)
+            ERR(s, "unlock");
+    }
+    JobGroup_release(g);
+}
+
+/**
+ * Add a job to the group and to the group's queue. On a bounded
+ * queue that is full, wait for room; see JobQueue_setCapacity.
+ */
+void JobGroup_add(JobGroup * g, int (*jobfun) (void *, void *),
+                  void *param) {
+    JobQueue *jq = g->jq;
+
+    if(!jq->acceptingJobs) {
+        fprintf(stderr, "%s:%s:%d: JobQueue not accepting jobs\n",
+                __FILE__, __func__, __LINE__);
+        exit(1);
+    }
+
+    JobQueue_waitForRoom(jq, 0);
+
+    Job *job = Job_alloc(jq);
+    Job_init(job, jobfun, param);
+    job->enqueued = JobQueue_stamp(jq);
+    job->group = g;
+    __atomic_add_fetch(&g->refs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&g->outstanding, 1, __ATOMIC_RELEASE);
+    JobQueue_push(jq, job);
+}
+
+/**
+ * Wait until every job added to the group so far has finished,
+ * regardless of other jobs in the queue. Return the status of the
+ * group's first failed job, or 0 if none has failed. The group may
+ * be reused after waiting. Like JobHandle_wait, a waiter may run
+ * other jobs while it waits.
+ */
+int JobGroup_wait(JobGroup * g) {
+    int status;
+
+    bool helps = JobQueue_helps(g->jq);
+    while(helps && __atomic_load_n(&g->outstanding, __ATOMIC_ACQUIRE) > 0) {
+        if(JobQueue_help(g->jq))
+            continue;
+        status = pthread_mutex_lock(&g->lock);
+        if(status)
+            ERR(status, "lock");
+        if(__atomic_load_n(&g->outstanding, __ATOMIC_ACQUIRE) > 0)
+            condNap(&g->finished, &g->lock);
+        status = pthread_mutex_unlock(&g->lock);
+        if(status)
+            ERR(status, "unlock");
+    }
+
+    if(__atomic_load_n(&g->outstanding, __ATOMIC_ACQUIRE) > 0) {
+        status = pthread_mutex_lock(&g->lock);
+        if(status)
+            ERR(status, "lock");
+        while(__atomic_load_n(&g->outstanding, __ATOMIC_ACQUIRE) > 0) {
+            status = pthread_cond_wait(&g->finished, &g->lock);
+            if(status)
+                ERR(status, "wait finished");
+        }
+        status = pthread_mutex_unlock(&g->lock);
+        if(status)
+            ERR(status, "unlock");
+    }
+    return __atomic_load_n(&g->firstError, __ATOMIC_RELAXED);
+}
+
+/// Number of the group's jobs that have returned nonzero.
+long JobGroup_errorCount(JobGroup * g) {
+    return __atomic_load_n(&g->nErrors, __ATOMIC_RELAXED);
+}
+
+/**
+ * Release the caller's reference to the group. Jobs that have not
+ * yet finished keep it alive until they do.
+ */
+void JobGroup_free(JobGroup * g) {
+    if(g != NULL)
+        JobGroup_release(g);
+}
+
+/// Create a cancellation token, not yet cancelled.
+CancelToken *CancelToken_new(void) {
+    CancelToken *t = malloc(sizeof(CancelToken));
+    CHECKMEM(t);
+    t->refs = 1;
+    t->cancelled = false;
+    return t;
+}
+
+/**
+ * Cancel every job that carries the token. Jobs that have not
+ * started are discarded, without running, when a worker reaches
+ * them, and finish with status ECANCELED. Running jobs can notice
+ * with JobQueue_jobCancelled.
+ */
+void CancelToken_cancel(CancelToken * t) {
+    __atomic_store_n(&t->cancelled, true, __ATOMIC_RELEASE);
+}
+
+/// Return true if the token has been cancelled.
+bool CancelToken_cancelled(CancelToken * t) {
+    return __atomic_load_n(&t->cancelled, __ATOMIC_ACQUIRE);
+}
+
+/// Drop one reference, and free the token when none remain.
+static void CancelToken_release(CancelToken * t) {
+    if(__atomic_sub_fetch(&t->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        free(t);
+}
+
+/// Release the caller's reference to a token.
+void CancelToken_free(CancelToken * t) {
+    if(t != NULL)
+        CancelToken_release(t);
+}
+
+/// Return true if a job should be skipped: cancelled or expired.
+static bool Job_skip(Job * job) {
+    if(job->token != NULL && CancelToken_cancelled(job->token))
+        return true;
+    return job->expires != 0 && monotonicNs() > job->expires;
+}
+
+/**
+ * Add a job that carries cancellation token t, which may be NULL,
+ * and that is skipped, rather than run, if it has not started within
+ * expiry seconds. Use expiry <= 0 for no limit. Jobs that this job
+ * submits carry t as well. A skipped job counts as discarded.
+ */
+void JobQueue_addJobCancelable(JobQueue * jq,
+                               int (*jobfun) (void *, void *),
+                               void *param, CancelToken * t,
+                               double expiry) {
+    assert(jq);
+    CHECKVALID(jq);
+
+    if(!jq->acceptingJobs) {
+        fprintf(stderr, "%s:%s:%d: JobQueue not accepting jobs\n",
+                __FILE__, __func__, __LINE__);
+        exit(1);
+    }
+
+    JobQueue_waitForRoom(jq, 0);
+
+    Job *job = Job_alloc(jq);
+    Job_init(job, jobfun, param);
+    if(t != NULL) {
+        if(job->token != NULL)
+            CancelToken_release(job->token);
+        __atomic_add_fetch(&t->refs, 1, __ATOMIC_RELAXED);
+        job->token = t;
+    }
+    job->enqueued = JobQueue_stamp(jq);
+    if(expiry > 0.0)
+        job->expires = monotonicNs() + (int64_t) (expiry * 1e9);
+    JobQueue_push(jq, job);
+}
+
+/**
+ * Return true if the job running on this thread should stop early:
+ * its token has been cancelled, or it has outlived its expiry.
+ * Cheap enough to call in an inner loop. Return false outside jobs.
+ */
+bool JobQueue_jobCancelled(void) {
+    return currJob != NULL && Job_skip(currJob);
+}
+
+/**
+ * Add n jobs at once, all of which call jobfun. The param of job i
+ * is base + i*stride, where stride is measured in bytes. The whole
+ * batch is queued in a single critical section, and only as many
+ * workers are woken as are needed to run it. In work-stealing mode,
+ * the batch goes onto the shared queue, even when submitted from
+ * within a job.
+ *
+ * On a bounded queue, a batch larger than the room left goes in
+ * chunks that fill the queue, waiting for the low-water mark between
+ * chunks, so that no more than capacity nodes are queued at once. A
+ * worker of this queue can't wait, so once the queue is full, it adds
+ * the rest of the batch whole.
+ */
+void JobQueue_addJobs(JobQueue * jq, int (*jobfun) (void *, void *),
+                      void *base, size_t stride, long n) {
+    assert(jq);
+
+    int status, nlaunch;
+    long i;
+    Job *head, *tail, *job;
+
+    CHECKVALID(jq);
+
+    if(!jq->acceptingJobs) {
+        fprintf(stderr, "%s:%s:%d: JobQueue not accepting jobs\n",
+                __FILE__, __func__, __LINE__);
+        exit(1);
+    }
 
-/// A single job in the queue
-struct Job {
-    struct Job *next;           // next job in queue
-    void *param;                // data for current job
-    int (*jobfun) (void *param, void *tdat);    // function that does job
-};
+    if(n <= 0)
+        return;
 
-/// All data used by job queue
-struct JobQueue {
+    for(long off = 0, m; off < n; off += m) {
+        // Admit as many as fit; a worker, which can't wait, gets no
+        // room and adds the rest.
+        m = n - off;
+        if(JobQueue_waitForRoom(jq, 0)) {
+            long cap = __atomic_load_n(&jq->capacity, __ATOMIC_RELAXED);
+            long room = cap - __atomic_load_n(&jq->nQueued,
+                                              __ATOMIC_RELAXED);
+            if(cap > 0 && room < m)
+                m = (room > 0 ? room : 1);
+        }
 
-    Job *todo;                  // list of jobs
-    bool acceptingJobs;         // false => don't wait for work
-    int maxThreads;             // maxumum number of threads
-    int nThreads;               // current number of threads
-    int idle;                   // number of idle threads
-    int valid;                  // has JobQueue been initialized
-    pthread_attr_t attr;        // create detached threads
-    pthread_mutex_t lock;       // for locking queue
-    pthread_cond_t wakeWorker;  // for waking workers
-    pthread_cond_t wakeMain;    // for waking main
+        // For LIFO order, fill the list back to front, so that the
+        // jobs run in the same order as if they had been added one
+        // at a time.
+        status = pthread_mutex_lock(&jq->lock);
+        if(status)
+            ERR(status, "lock");
+        JobOrder order = (jq->deterministic ? JOBQUEUE_FIFO : jq->order);
+        status = pthread_mutex_unlock(&jq->lock);
+        if(status)
+            ERR(status, "unlock");
 
-    // These items allow each thread to construct an object that
-    // persists for the life of the thread, is passed to each job
-    // processed by that thread, and is destroyed when the thread
-    // terminates. This allows the thread to maintain, for example, a
-    // random number generator, which is used sequentially by all
-    // tasks executed by that thread, but is only allocated and freed
-    // once.
-    void *threadData;           // constructor argument; not locally owned
-    void *(*ThreadState_new) (void *threadData);    // constuctor
-    void (*ThreadState_free) (void *threadState);   // destructor
-};
+        int64_t now = JobQueue_stamp(jq);
+        head = Job_allocList(jq, m, &tail);
+        for(i = 0, job = head; job != NULL; ++i, job = job->next) {
+            long k = off + (order == JOBQUEUE_FIFO ? i : m - 1 - i);
+            Job_init(job, jobfun, (char *) base + k * stride);
+            job->enqueued = now;
+            TRACE(jq, TRACE_ENQUEUE, job);
+        }
 
-#define JOBQUEUE_VALID 8131950
+        status = pthread_mutex_lock(&jq->lock);
+        if(status)
+            ERR(status, "lock");
 
-#if 0
-pthread_mutex_t stdoutLock = PTHREAD_MUTEX_INITIALIZER;
-#endif
+        JobQueue_enqueue(jq, head, tail, m);
 
-void *threadfun(void *varg);
-void Job_free(Job * job);
-#ifdef DPRINTF_ON
-void Job_print(Job * job);
+        nlaunch = JobQueue_wake(jq, m);
 
-void Job_print(Job * job) {
-    if(job == NULL) {
-        putchar('\n');
-        return;
+        status = pthread_mutex_unlock(&jq->lock);
+        if(status)
+            ERR(status, "unlock");
+        JobQueue_launch(jq, nlaunch);
     }
-    printf("%p->", job);
-    Job_print(job->next);
 }
-#endif
 
-JobQueue *JobQueue_new(int maxThreads, void *threadData,
-                       void *(*ThreadState_new) (void *),
-                       void (*ThreadState_free) (void *)) {
-    int i;
-    JobQueue *jq = malloc(sizeof(JobQueue));
-    CHECKMEM(jq);
+/**
+ * Decide whether a parallelFor job should split its range, which it
+ * does only when another worker could take the other half: when
+ * there are idle or unlaunched workers, or when there is nothing
+ * else queued for the busy ones.
+ */
+static bool ParFor_shouldSplit(JobQueue * jq) {
+    if(__atomic_load_n(&jq->idle, __ATOMIC_RELAXED) > 0
+       || __atomic_load_n(&jq->nThreads, __ATOMIC_RELAXED)
+       < __atomic_load_n(&jq->maxThreads, __ATOMIC_RELAXED))
+        return true;
+    if(jq->workStealing && currWorker != NULL && currWorker->jq == jq)
+        return Deque_empty(currWorker->deque);
+    return __atomic_load_n(&jq->nQueued, __ATOMIC_RELAXED) == 0;
+}
 
-    jq->todo = NULL;
-    jq->acceptingJobs = true;
-    jq->idle = jq->nThreads = 0;
-    jq->maxThreads = maxThreads;
-    jq->threadData = threadData;
-    jq->ThreadState_new = ThreadState_new;
-    jq->ThreadState_free = ThreadState_free;
+/**
+ * Run fn on a single chunk, [lo, hi). With automatic grain size,
+ * time the chunk and reset the grain so that chunks will take about
+ * JOBQUEUE_GRAIN_NS nanoseconds. Once any chunk has failed, the rest
+ * are skipped.
+ */
+static void ParFor_chunk(ParFor * pf, long lo, long hi, void *threadState) {
+    struct timespec t0, t1;
+    int status, zero = 0;
 
-    // set attr for detached threads
-    if((i = pthread_attr_init(&jq->attr))) {
-        fprintf(stderr, "%s:%d: pthread_attr_init returned %d (%s)",
-                __FILE__, __LINE__, i, strerror(i));
-        exit(1);
-    }
-    if((i = pthread_attr_setdetachstate(&jq->attr, PTHREAD_CREATE_DETACHED))) {
-        fprintf(stderr, "%s:%d: pthread_attr_setdetachstate returned %d (%s)",
-                __FILE__, __LINE__, i, strerror(i));
-        exit(1);
-    }
+    if(__atomic_load_n(&pf->status, __ATOMIC_RELAXED) != 0)
+        return;
 
-    if((i = pthread_mutex_init(&jq->lock, NULL))) {
-        fprintf(stderr, "%s:%d: pthread_mutex_init returned %d (%s)",
-                __FILE__, __LINE__, i, strerror(i));
-        exit(1);
-    }
+    if(pf->autoGrain)
+        clock_gettime(CLOCK_MONOTONIC, &t0);
 
-    if((i = pthread_cond_init(&jq->wakeWorker, NULL))) {
-        fprintf(stderr, "%s:%d: pthread_cond_init returned %d (%s)",
-                __FILE__, __LINE__, i, strerror(i));
-        exit(1);
-    }
+    status = pf->fn(pf->ctx, lo, hi, threadState);
+    if(status)
+        __atomic_compare_exchange_n(&pf->status, &zero, status, false,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
 
-    if((i = pthread_cond_init(&jq->wakeMain, NULL))) {
-        fprintf(stderr, "%s:%d: pthread_cond_init returned %d (%s)",
-                __FILE__, __LINE__, i, strerror(i));
-        exit(1);
+    if(pf->autoGrain) {
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        double ns = 1e9 * (t1.tv_sec - t0.tv_sec)
+            + (t1.tv_nsec - t0.tv_nsec);
+        double g = pf->maxGrain;
+        if(ns > 0.0)
+            g = JOBQUEUE_GRAIN_NS * (hi - lo) / ns;
+        if(g > pf->maxGrain)
+            g = pf->maxGrain;
+        if(g < 1.0)
+            g = 1.0;
+        __atomic_store_n(&pf->grain, (long) g, __ATOMIC_RELAXED);
     }
+}
 
-    jq->valid = JOBQUEUE_VALID;
+/**
+ * The jobfun of parallelFor jobs. The job's range is split lazily:
+ * while the range is larger than the grain, either push its upper
+ * half back onto the queue, or if no one would take it, run one
+ * grain's worth from the bottom.
+ */
+static int ParFor_run(void *param, void *threadState) {
+    ParFor *pf = (ParFor *) param;
+    JobQueue *jq = pf->jq;
+    long lo = currJob->lo, hi = currJob->hi, n, ndone = 0;
 
-    return jq;
-}
+    while(lo < hi) {
+        long grain = __atomic_load_n(&pf->grain, __ATOMIC_RELAXED);
+        n = hi - lo;
+        if(n > grain && ParFor_shouldSplit(jq)) {
+            long mid = lo + n / 2;
+            Job *job = Job_alloc(jq);
+            Job_init(job, ParFor_run, pf);
+            job->lo = mid;
+            job->hi = hi;
+            JobQueue_push(jq, job);
+            hi = mid;
+            continue;
+        }
+        if(n > grain)
+            n = grain;
+        ParFor_chunk(pf, lo, lo + n, threadState);
+        lo += n;
+        ndone += n;
+    }
 
-void JobQueue_addJob(JobQueue * jq, int (*jobfun) (void *, void *),
-                     void *param) {
-    assert(jq);
+    ParFor_finish(pf, ndone);
+    return 0;
+}
 
+/**
+ * Account for ndone finished (or discarded) iterations, and wake the
+ * caller of JobQueue_parallelFor if none remain.
+ */
+static void ParFor_finish(ParFor * pf, long ndone) {
     int status;
-    pthread_t id;
 
-    if(jq->valid != JOBQUEUE_VALID) {
-        fprintf(stderr, "%s:%d: JobQueue not initialized", __func__,
-                __LINE__);
-        exit(1);
+    if(__atomic_sub_fetch(&pf->remaining, ndone, __ATOMIC_ACQ_REL) == 0) {
+        status = pthread_mutex_lock(&pf->lock);
+        if(status)
+            ERR(status, "lock");
+        pf->finished = true;
+        status = pthread_cond_signal(&pf->done);
+        if(status)
+            ERR(status, "signal done");
+        status = pthread_mutex_unlock(&pf->lock);
+        if(status)
+            ERR(status, "unlock");
     }
+}
+
+/**
+ * Call fn(ctx, lo, hi, threadState) on chunks [lo, hi) that together
+ * cover [begin, end), and wait until all have finished. Each chunk
+ * runs in a worker, which passes its own threadState. Ranges are
+ * split lazily and recursively, so that a worker with a large range
+ * gives away half only when another worker could use it.
+ *
+ * If grain > 0, no chunk is larger than grain. If grain <= 0, the
+ * grain is chosen and adjusted from the measured cost per iteration.
+ *
+ * Return 0 if every call to fn returned 0. Otherwise, return the
+ * first nonzero value, in which case chunks that had not yet started
+ * are skipped. May be called from within a job: the calling worker
+ * helps run chunks and other queued jobs while it waits, so nesting
+ * never deadlocks, however few the workers.
+ */
+int JobQueue_parallelFor(JobQueue * jq, long begin, long end, long grain,
+                         int (*fn) (void *ctx, long lo, long hi,
+                                    void *threadState), void *ctx) {
+    int status;
+
+    CHECKVALID(jq);
 
     if(!jq->acceptingJobs) {
         fprintf(stderr, "%s:%s:%d: JobQueue not accepting jobs\n",
@@ -171,142 +3931,413 @@ void JobQueue_addJob(JobQueue * jq, int (*jobfun) (void *, void *),
         exit(1);
     }
 
-    Job *job = malloc(sizeof(Job));
-    CHECKMEM(job);
-    job->jobfun = jobfun;
-    job->param = param;
+    if(end <= begin)
+        return 0;
 
-    status = pthread_mutex_lock(&jq->lock);
+    ParFor pf = {
+        .jq = jq,
+        .fn = fn,
+        .ctx = ctx,
+        .autoGrain = (grain <= 0),
+        .grain = (grain > 0 ? grain : 1),
+        .maxGrain = (end - begin)
+            / (4 * __atomic_load_n(&jq->maxThreads, __ATOMIC_RELAXED)),
+        .remaining = end - begin,
+        .status = 0,
+        .finished = false
+    };
+    if(pf.maxGrain < 1)
+        pf.maxGrain = 1;
+
+    if((status = pthread_mutex_init(&pf.lock, NULL)))
+        ERR(status, "mutex_init");
+    if((status = pthread_cond_init(&pf.done, NULL)))
+        ERR(status, "cond_init");
+
+    Job *job = Job_alloc(jq);
+    Job_init(job, ParFor_run, &pf);
+    job->lo = begin;
+    job->hi = end;
+    JobQueue_push(jq, job);
+
+    bool helps = JobQueue_helps(jq);
+    status = pthread_mutex_lock(&pf.lock);
     if(status)
         ERR(status, "lock");
+    while(!pf.finished) {
+        if(helps) {
+            status = pthread_mutex_unlock(&pf.lock);
+            if(status)
+                ERR(status, "unlock");
+            bool ran = JobQueue_help(jq);
+            status = pthread_mutex_lock(&pf.lock);
+            if(status)
+                ERR(status, "lock");
+            if(!ran && !pf.finished)
+                condNap(&pf.done, &pf.lock);
+            continue;
+        }
+        status = pthread_cond_wait(&pf.done, &pf.lock);
+        if(status)
+            ERR(status, "wait done");
+    }
+    status = pthread_mutex_unlock(&pf.lock);
+    if(status)
+        ERR(status, "unlock");
 
-    job->next = jq->todo;
-    jq->todo = job;
+    status = pthread_mutex_destroy(&pf.lock);
+    if(status)
+        ERR(status, "destroy lock");
+    status = pthread_cond_destroy(&pf.done);
+    if(status)
+        ERR(status, "destroy done");
 
-#ifdef DPRINTF_ON
-    printf("%s:%d:queue:", __func__, __LINE__);
-    Job_print(jq->todo);
-#endif
+    return pf.status;
+}
 
-    // If threads are idling, wake one
-    if(jq->idle > 0) {
+/**
+ * Try to steal a job from the other workers' deques. Return NULL if
+ * none of them has any work.
+ */
+static Job *Worker_steal(Worker * w) {
+    JobQueue *jq = w->jq;
+    int i, n = __atomic_load_n(&jq->hiSlot, __ATOMIC_ACQUIRE);
+    bool retry;
 
-        status = pthread_cond_signal(&jq->wakeWorker);
-        if(status)
-            ERR(status, "signal wakeWorker");
+    do {
+        retry = false;
+        for(i = 1; i < n; ++i) {
+            Worker *victim = jq->workers + (w->index + i) % n;
+            void *p = Deque_steal(victim->deque);
+            if(p == DEQUE_ABORT)
+                retry = true;
+            else if(p != NULL) {
+                STAT_ADD(w->stats->jobsStolen, 1);
+                return (Job *) p;
+            }
+        }
+    } while(retry);
+    return NULL;
+}
 
-    } else if(jq->nThreads < jq->maxThreads) {
+/**
+ * Look for work without holding jq->lock or sleeping. Spin for up to
+ * w->spinNs nanoseconds, then yield JOBQUEUE_SPIN_YIELDS times.
+ * Called by a worker counted in jq->idle and jq->spinning. Return
+ * true if the shared queue has jobs, if the queue has stopped
+ * accepting jobs, or if a job was stolen, in which case it is
+ * returned in *job. Return false if the wait timed out.
+ */
+static bool Worker_spin(Worker * w, Job ** job) {
+    JobQueue *jq = w->jq;
+    int64_t limit = __atomic_load_n(&jq->spinNs, __ATOMIC_RELAXED);
+    int64_t deadline = 0;
+    long i;
 
-        // launch a new thread
-        DPRINTF(("%s:%d launching thread\n", __func__, __LINE__));
-        status = pthread_create(&id, &jq->attr, threadfun, (void *) jq);
-        if(status) {
-            fprintf(stderr, "%s:%d: pthread_create returned %d (%s)\n",
-                    __func__, __LINE__, status, strerror(status));
-            exit(1);
-        }
-        ++jq->nThreads;
+    if(w->spinNs > limit)
+        w->spinNs = limit;
+    if(jq->multiCore && w->spinNs > 0)
+        deadline = monotonicNs() + w->spinNs;
 
+    // spin, then yield
+    for(i = 0;; ++i) {
+        if(__atomic_load_n(&jq->nQueued, __ATOMIC_RELAXED) > 0
+           || !__atomic_load_n(&jq->acceptingJobs, __ATOMIC_RELAXED))
+            break;
+        if(jq->workStealing && (*job = Worker_steal(w)) != NULL)
+            break;
+        if(deadline > 0) {
+            CPU_RELAX();
+            if(i % JOBQUEUE_SPIN_CHECK == JOBQUEUE_SPIN_CHECK - 1
+               && monotonicNs() >= deadline) {
+                deadline = 0;
+                i = -1;
+            }
+        } else if(i < JOBQUEUE_SPIN_YIELDS) {
+            sched_yield();
+        } else {
+            // Timed out: spin less next time.
+            w->spinNs /= 2;
+            return false;
+        }
     }
+    w->spinNs = limit;
+    return true;
+}
 
-    status = pthread_mutex_unlock(&jq->lock);
-    if(status)
-        ERR(status, "unlock");
-    else
-        DPRINTF(("%s:%s:%d: unlocked\n", __FILE__, __func__, __LINE__));
+/**
+ * Decide whether a worker should leave the pool: at once if the pool
+ * is over maxThreads, or, if it has timed out while idle, as long as
+ * the pool stays at or above minThreads, or if another member of a
+ * shared pool is waiting for its slot. Call with jq->lock held, from
+ * a worker whose deque is empty. A worker that would leave for want
+ * of work stays if a job has arrived, because a submitter that saw
+ * nThreads before the decrement may have skipped the wakeup. Return
+ * true if the worker has been removed from nThreads.
+ */
+static bool Worker_retire(Worker * w, bool timedOut) {
+    JobQueue *jq = w->jq;
+    int n = __atomic_load_n(&jq->nThreads, __ATOMIC_RELAXED);
+
+    // Jobs already dealt to this worker would be stranded.
+    if(jq->deterministic)
+        return false;
+
+    if(n > jq->maxThreads) {
+        __atomic_sub_fetch(&jq->nThreads, 1, __ATOMIC_SEQ_CST);
+        return true;
+    }
+    if((!timedOut || n <= jq->minThreads) && !JobPool_wanted(jq))
+        return false;
+    __atomic_sub_fetch(&jq->nThreads, 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&jq->nQueued, __ATOMIC_SEQ_CST) > 0) {
+        __atomic_add_fetch(&jq->nThreads, 1, __ATOMIC_SEQ_CST);
+        return false;
+    }
+    return true;
 }
 
 /**
  * Waits until there is a job in the queue, pops it off and executes
  * it, then waits for another.  Runs until jobs are completed and
- * main thread sets acceptingJobs=0.
+ * main thread sets acceptingJobs=0, or until the worker retires.
+ *
+ * In work-stealing mode, the worker looks first in its own deque,
+ * then in the deques of other workers, and finally in the shared
+ * queue.
  */
 void *threadfun(void *arg) {
-    DPRINTF(("%s %lu entry\n", __func__, (unsigned long) pthread_self()));
-
-    //    struct timespec timeout;
-    JobQueue *jq = (JobQueue *) arg;
+    struct timespec timeout;
+    Worker *w = (Worker *) arg;
+    JobQueue *jq = w->jq;
     Job *job;
     int status;
+    bool retired = false;
     void *threadState = NULL;
+    JobQueue *next = NULL;      // member given our slot of jq->pool
+
+    // Wait until JobQueue_launch has recorded our thread id, so that
+    // whoever reuses this slot can join us.
+    while(!__atomic_load_n(&w->launched, __ATOMIC_ACQUIRE))
+        sched_yield();
+    if(w->joinPrev) {
+        status = pthread_join(w->prev, NULL);
+        if(status)
+            ERR(status, "pthread_join");
+        w->joinPrev = false;
+    }
+
+    currWorker = w;
+    if(w->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(w->cpu, &set);
+        status = pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+        if(status)
+            ERR(status, "pthread_setaffinity_np");
+    }
     if(jq->ThreadState_new != NULL) {
         threadState = jq->ThreadState_new(jq->threadData);
         CHECKMEM(threadState);
     }
+    w->threadState = threadState;
+    Arena_init(&w->arena, jq->arenaSize);
+    currArena = &w->arena;
+    w->heldSince = monotonicNs();
+
+    // Announce that we are ready, for JobQueue_prespawn.
+    status = pthread_mutex_lock(&jq->lock);
+    if(status)
+        ERR(status, "lock");
+    ++jq->nReady;
+    status = pthread_cond_broadcast(&jq->wakeMain);
+    if(status)
+        ERR(status, "broadcast wakeMain");
+    status = pthread_mutex_unlock(&jq->lock);
+    if(status)
+        ERR(status, "unlock");
 
     for(;;) {
-        //        clock_gettime(CLOCK_REALTIME, &timeout);
-        //        timeout.tv_sec += 3;
+        bool timing = __atomic_load_n(&jq->timing, __ATOMIC_RELAXED);
+        int64_t t0 = 0, t1;
 
-        status = pthread_mutex_lock(&jq->lock); // LOCK
-        if(status)
-            ERR(status, "lock");
-        else
-            DPRINTF(("%s:%s:%d: locked\n", __FILE__, __func__, __LINE__));
+        job = NULL;
+        if(jq->workStealing) {
+            job = Deque_pop(w->deque);
+            if(job == NULL)
+                job = Worker_steal(w);
+        }
+
+        if(job == NULL) {
+            if(timing)
+                t0 = monotonicNs();
+            status = pthread_mutex_lock(&jq->lock); // LOCK
+            if(status)
+                ERR(status, "lock");
+            if(timing)
+                STAT_ADD(w->stats->lockNs, monotonicNs() - t0);
+
+            // Wait while there is no work and queue is accepting jobs
+            bool spun = false, timedOut = false;
+            for(;;) {
+                if(Worker_retire(w, timedOut)) {
+                    retired = true;
+                    break;
+                }
+                timedOut = false;
+                if((job = JobQueue_dequeueFor(jq, w)) != NULL) {
+                    // Submitters don't signal when someone is
+                    // spinning, so the spinner that finds a burst of
+                    // jobs must pass the word.
+                    if(__atomic_load_n(&jq->nQueued, __ATOMIC_RELAXED) > 0
+                       && jq->spinning == 0
+                       && jq->idle > 0) {
+                        status = pthread_cond_signal(&jq->wakeWorker);
+                        if(status)
+                            ERR(status, "signal wakeWorker");
+                    }
+                    break;
+                }
+
+                // Count ourselves as idle before scanning the
+                // deques, so that a worker pushing onto its deque
+                // either sees us or has its job seen by us.
+                __atomic_add_fetch(&jq->idle, 1, __ATOMIC_SEQ_CST);
+
+                // Likewise, a submitter using the inbox either sees
+                // us, or has its job counted in nQueued here. Dealt
+                // jobs are queued under the lock, and ours would have
+                // been dequeued above.
+                if(!jq->deterministic
+                   && __atomic_load_n(&jq->nQueued, __ATOMIC_SEQ_CST) > 0) {
+                    __atomic_sub_fetch(&jq->idle, 1, __ATOMIC_SEQ_CST);
+                    continue;
+                }
+                if(jq->workStealing && (job = Worker_steal(w)) != NULL) {
+                    __atomic_sub_fetch(&jq->idle, 1, __ATOMIC_SEQ_CST);
+                    break;
+                }
 
-        // Wait while the queue is empty and accepting jobs
-        while(NULL == jq->todo && jq->acceptingJobs) {
-            DPRINTF(("%s:%d:  awaiting work. todo=%p\n",
-                     __func__, __LINE__, jq->todo));
+                /*
+                 * todo accepting
+                 *   0     0  <- exit
+                 *   0     1  <- wait
+                 *   1     0  <- do work
+                 *   1     1  <- do work
+                 */
+                if(!jq->acceptingJobs) {
+                    __atomic_sub_fetch(&jq->idle, 1, __ATOMIC_SEQ_CST);
+                    break;
+                }
 
-            ++jq->idle;
-            if(jq->idle == jq->nThreads) {
-                status = pthread_cond_signal(&jq->wakeMain);
+                // Another member may be waiting for our slot; see
+                // JobPool_kick.
+                if(JobPool_wanted(jq)) {
+                    __atomic_sub_fetch(&jq->idle, 1, __ATOMIC_SEQ_CST);
+                    continue;
+                }
+
+                if(jq->idle + jq->nWaiting == jq->nThreads) {
+                    status = pthread_cond_signal(&jq->wakeMain);
+                    if(status)
+                        ERR(status, "signal wakeMain");
+                }
+
+                // Spin before parking, unless we just spun in vain.
+                // Spinners watch the shared queue, which dealt jobs
+                // bypass.
+                if(!spun && !jq->deterministic
+                   && __atomic_load_n(&jq->spinNs, __ATOMIC_RELAXED) > 0) {
+                    __atomic_add_fetch(&jq->spinning, 1, __ATOMIC_SEQ_CST);
+                    status = pthread_mutex_unlock(&jq->lock);
+                    if(status)
+                        ERR(status, "unlock");
+                    if(timing)
+                        t0 = monotonicNs();
+                    spun = !Worker_spin(w, &job);
+                    if(timing)
+                        STAT_ADD(w->stats->idleNs, monotonicNs() - t0);
+                    status = pthread_mutex_lock(&jq->lock);
+                    if(status)
+                        ERR(status, "lock");
+                    __atomic_sub_fetch(&jq->spinning, 1, __ATOMIC_SEQ_CST);
+                    __atomic_sub_fetch(&jq->idle, 1, __ATOMIC_SEQ_CST);
+                    if(job != NULL)
+                        break;
+                    continue;
+                }
+
+                STAT_ADD(w->stats->parks, 1);
+                TRACE(jq, TRACE_PARK, NULL);
+                if(timing)
+                    t0 = monotonicNs();
+                pthread_cond_t *wake = (jq->deterministic ? &w->wake
+                                        : &jq->wakeWorker);
+                w->parked = true;
+                if(jq->idleNs > 0) {
+                    int64_t t = monotonicNs() + jq->idleNs;
+                    timeout.tv_sec = t / 1000000000LL;
+                    timeout.tv_nsec = t % 1000000000LL;
+                    status = pthread_cond_timedwait(wake, &jq->lock,
+                                                    &timeout);
+                } else
+                    status = pthread_cond_wait(wake, &jq->lock);
+                w->parked = false;
+                if(timing)
+                    STAT_ADD(w->stats->idleNs, monotonicNs() - t0);
+                TRACE(jq, TRACE_WAKE, NULL);
+                __atomic_sub_fetch(&jq->idle, 1, __ATOMIC_SEQ_CST);
+                spun = false;
+                if(status == ETIMEDOUT) {
+                    timedOut = true;
+                    continue;
+                }
                 if(status)
-                    ERR(status, "signal wakeMain");
+                    ERR(status, "wait wakeWorker");
             }
-            //status = pthread_cond_timedwait(&jq->wakeWorker, &jq->lock,
-            //                                &timeout);
-            status = pthread_cond_wait(&jq->wakeWorker, &jq->lock);
-            --jq->idle;
-            //if(status == ETIMEDOUT)
-            //    continue;
-            if(status)
-                ERR(status, "wait wakeWorker");
-        }
-
-        /*
-         * todo accepting
-         *   0     0  <- exit
-         *   0     1  <- stay in while loop
-         *   1     0  <- do work
-         *   1     1  <- do work
-         */
 
-        if(NULL == jq->todo) {  // shutting down
-            assert(!jq->acceptingJobs);
-            break;
-        } else {                // do job
-            DPRINTF(("%s %lu got work\n", __func__,
-                     (unsigned long) pthread_self()));
-
-            // remove job from queue
-            assert(NULL != jq->todo);
-            job = jq->todo;
-            jq->todo = jq->todo->next;
-
-#ifdef DPRINTF_ON
-            printf("%s:%d:queue:", __func__, __LINE__);
-            Job_print(jq->todo);
-#endif
+            if(job == NULL) {   // shutting down or retiring
+                assert(retired || !jq->acceptingJobs);
+                break;          // still have lock
+            }
 
             status = pthread_mutex_unlock(&jq->lock);   // UNLOCK
             if(status)
                 ERR(status, "unlock");
-            else
-                DPRINTF(("%s:%s:%d: unlocked\n", __FILE__, __func__,
-                         __LINE__));
+        }
 
-            DPRINTF(("%s %lu calling jobfun\n", __func__,
-                     (unsigned long) pthread_self()));
-            job->jobfun(job->param, threadState);
-            DPRINTF(("%s %lu back fr jobfun\n", __func__,
-                     (unsigned long) pthread_self()));
-            free(job);
+        timing = __atomic_load_n(&jq->timing, __ATOMIC_RELAXED);
+        if(timing) {
+            t0 = monotonicNs();
+            if(job->enqueued != 0)
+                STAT_ADD(w->stats->waitHist[histBin(t0 - job->enqueued)],
+                         1);
+        }
+        TRACE(jq, TRACE_START, job);
+        JobQueue_runJob(jq, job, threadState);
+        TRACE(jq, TRACE_FINISH, job);   // job is stale; used only as id
+        STAT_ADD(w->stats->jobsRun, 1);
+        if(timing) {
+            t1 = monotonicNs() - t0;
+            STAT_ADD(w->stats->runNs, t1);
+            STAT_ADD(w->stats->runHist[histBin(t1)], 1);
+        }
+        if(jq->pool != NULL && (next = Worker_yield(w)) != NULL) {
+            status = pthread_mutex_lock(&jq->lock);
+            if(status)
+                ERR(status, "lock");
+            __atomic_sub_fetch(&jq->nThreads, 1, __ATOMIC_SEQ_CST);
+            retired = true;
+            break;
         }
     }
     // still have lock
-    --jq->nThreads;
+    if(!retired)
+        __atomic_sub_fetch(&jq->nThreads, 1, __ATOMIC_SEQ_CST);
+    --jq->nReady;
+    __atomic_store_n(&w->state, WORKER_FREE, __ATOMIC_RELAXED);
+    if(jq->pool != NULL)
+        next = JobPool_leave(jq->pool, jq, next);
 
     status = pthread_cond_signal(&jq->wakeMain);
     if(status)
@@ -315,13 +4346,16 @@ void *threadfun(void *arg) {
     status = pthread_mutex_unlock(&jq->lock);   // UNLOCK
     if(status)
         ERR(status, "unlock");
-    else
-        DPRINTF(("%s:%s:%d: unlocked\n", __FILE__, __func__, __LINE__));
 
+    w->threadState = NULL;
+    currArena = NULL;
+    Arena_free(&w->arena);
     if(threadState)
         jq->ThreadState_free(threadState);
 
-    DPRINTF(("%s %lu exit\n", __func__, (unsigned long) pthread_self()));
+    currWorker = NULL;
+    if(next != NULL)
+        JobPool_hand(jq->pool, next);
     return NULL;
 }
 
@@ -329,8 +4363,6 @@ void *threadfun(void *arg) {
 void JobQueue_noMoreJobs(JobQueue * jq) {
     int status;
 
-    DPRINTF(("%s:%d: entry\n", __func__, __LINE__));
-
     if(jq->valid != JOBQUEUE_VALID) {
         fprintf(stderr, "%s:%d: JobQueue not initialized", __func__,
                 __LINE__);
@@ -340,33 +4372,35 @@ void JobQueue_noMoreJobs(JobQueue * jq) {
     status = pthread_mutex_lock(&jq->lock);
     if(status)
         ERR(status, "lock");
-    else
-        DPRINTF(("%s:%s:%d: locked\n", __FILE__, __func__, __LINE__));
 
-    jq->acceptingJobs = false;
+    __atomic_store_n(&jq->acceptingJobs, false, __ATOMIC_RELAXED);
+
+    if(jq->nBlocked > 0) {
+        status = pthread_cond_broadcast(&jq->wakeSubmitter);
+        if(status)
+            ERR(status, "broadcast wakeSubmitter");
+    }
 
     if(jq->idle > 0) {
         // Wake workers so they can quit
-        DPRINTF(("%s:%d: telling workers to quit\n", __func__, __LINE__));
-        status = pthread_cond_broadcast(&jq->wakeWorker);
-        if(status)
-            ERR(status, "broadcast wakeWorker");
+        JobQueue_wakeAll(jq);
     }
 
     status = pthread_mutex_unlock(&jq->lock);
     if(status)
         ERR(status, "unlock");
-    else
-        DPRINTF(("%s:%s:%d: unlocked\n", __FILE__, __func__, __LINE__));
-
-    DPRINTF(("%s:%d: exit\n", __func__, __LINE__));
 }
 
-/// Wait until all threads are idle
+/**
+ * Wait until all threads are idle. A job may call this too, to wait
+ * for the jobs it and others have submitted: the worker runs queued
+ * jobs while it waits, and counts as idle to other workers that do
+ * the same, so that it returns once every job that isn't itself
+ * waiting has finished.
+ */
 void JobQueue_waitOnJobs(JobQueue * jq) {
     int status;
-
-    DPRINTF(("%s:%d: entry\n", __func__, __LINE__));
+    bool worker = (currWorker != NULL && currWorker->jq == jq);
 
     if(jq->valid != JOBQUEUE_VALID) {
         fprintf(stderr, "%s:%d: JobQueue not initialized", __func__,
@@ -377,52 +4411,65 @@ void JobQueue_waitOnJobs(JobQueue * jq) {
     status = pthread_mutex_lock(&jq->lock);
     if(status)
         ERR(status, "lock");
-    else
-        DPRINTF(("%s:%s:%d: locked\n", __FILE__, __func__, __LINE__));
-
-    // Wait until jobs are finished.
-    while(jq->todo != NULL || jq->idle < jq->nThreads) {
-        DPRINTF(("%s:%d: waiting; idle=%d/%d\n",
-                 __func__, __LINE__, jq->idle, jq->nThreads));
 
-        // If any workers are idle, wake one
-        if(jq->idle > 0) {
-            status = pthread_cond_signal(&jq->wakeWorker);
+    // Wait until jobs are finished, running queued ones meanwhile if
+    // we are a worker or in caller-helps mode.
+    // A worker's deque is not in nQueued, so it looks for work, in
+    // its own deque and others, before deciding that all is done.
+    // Waiting workers count as quiescent, but not while they run a
+    // job in JobQueue_help, or another waiter could decide that all
+    // is done while that job is still adding work. Likewise, jobs
+    // that other threads are running for us count in nHelping.
+    if(worker)
+        ++jq->nWaiting;
+    for(;;) {
+        if(JobQueue_helps(jq)) {
+            if(worker)
+                --jq->nWaiting;
+            status = pthread_mutex_unlock(&jq->lock);
+            if(status)
+                ERR(status, "unlock");
+            bool ran = JobQueue_help(jq);
+            status = pthread_mutex_lock(&jq->lock);
             if(status)
-                ERR(status, "signal wakeWorker");
+                ERR(status, "lock");
+            if(worker)
+                ++jq->nWaiting;
+            if(ran)
+                continue;
         }
 
+        if(__atomic_load_n(&jq->nQueued, __ATOMIC_RELAXED) == 0
+           && jq->nHelping == 0
+           && jq->idle + (worker ? jq->nWaiting : 0) >= jq->nThreads)
+            break;
+
+        if(currWorker != NULL) {
+            condNap(&jq->wakeMain, &jq->lock);
+            continue;
+        }
         status = pthread_cond_wait(&jq->wakeMain, &jq->lock);
         if(status)
             ERR(status, "wait wakeMain");
     }
+    if(worker) {
+        --jq->nWaiting;
+        status = pthread_mutex_unlock(&jq->lock);
+        if(status)
+            ERR(status, "unlock");
+        return;
+    }
 
-    assert(jq->todo == NULL && jq->idle == jq->nThreads);
-    DPRINTF(("%s:%d: queue is empty and all threads are idle\n",
-             __func__, __LINE__));
+    assert(jq->idle == jq->nThreads);
 
     if(!jq->acceptingJobs) {
         // We're done: wake all workers so they can quit
-        DPRINTF(("%s:%d: telling workers to quit\n", __func__, __LINE__));
-        status = pthread_cond_broadcast(&jq->wakeWorker);
-        if(status)
-            ERR(status, "broadcast wakeWorker");
+        JobQueue_wakeAll(jq);
     }
 
     status = pthread_mutex_unlock(&jq->lock);
     if(status)
         ERR(status, "unlock");
-    else
-        DPRINTF(("%s:%s:%d: unlocked\n", __FILE__, __func__, __LINE__));
-
-    DPRINTF(("%s:%d: exit\n", __func__, __LINE__));
-}
-
-void Job_free(Job * job) {
-    if(NULL == job)
-        return;
-    Job_free(job->next);
-    free(job);
 }
 
 void JobQueue_free(JobQueue * jq) {
@@ -439,14 +4486,42 @@ void JobQueue_free(JobQueue * jq) {
     JobQueue_noMoreJobs(jq);
     JobQueue_waitOnJobs(jq);
 
-    // sleep to give threads time to release mutex
-    struct timespec t = {
-        .tv_sec = 0,
-        .tv_nsec = 10000000L    // 1/100 of a second
-    };
-    status = nanosleep(&t, NULL);
-    if(status)
-        ERR(status, "nanosleep");
+    // Leave the pool, once no other thread is still using jq for it.
+    if(jq->pool != NULL) {
+        JobPool *pool = jq->pool;
+        status = pthread_mutex_lock(&pool->lock);
+        if(status)
+            ERR(status, "lock pool");
+        if(jq->poolWaiting) {
+            jq->poolWaiting = false;
+            __atomic_sub_fetch(&pool->nWaiting, 1, __ATOMIC_SEQ_CST);
+        }
+        while(jq->poolPins > 0) {
+            status = pthread_cond_wait(&jq->poolWake, &pool->lock);
+            if(status)
+                ERR(status, "wait poolWake");
+        }
+        JobQueue **p = &pool->members;
+        while(*p != jq)
+            p = &(*p)->poolNext;
+        *p = jq->poolNext;
+        status = pthread_mutex_unlock(&pool->lock);
+        if(status)
+            ERR(status, "unlock pool");
+    }
+
+    // Every worker is now idle and has been told to exit. Join them,
+    // and any that retired earlier, so that none is still touching jq
+    // when it is destroyed. No job is running, so no thread is in
+    // JobQueue_launch.
+    for(int i = 0; i < jq->nSlots; ++i) {
+        if(!jq->workers[i].launched)
+            continue;
+        status = pthread_join(jq->workers[i].thread, NULL);
+        if(status)
+            ERR(status, "pthread_join");
+        jq->workers[i].launched = false;
+    }
 
     status = pthread_attr_destroy(&jq->attr);
     if(status)
@@ -460,10 +4535,55 @@ void JobQueue_free(JobQueue * jq) {
     if(status)
         ERR(status, "destroy wakeWorker");
 
+    for(int i = 0; i < jq->nSlots; ++i) {
+        status = pthread_cond_destroy(&jq->workers[i].wake);
+        if(status)
+            ERR(status, "destroy wake");
+    }
+
+    status = pthread_cond_destroy(&jq->poolWake);
+    if(status)
+        ERR(status, "destroy poolWake");
+
+    // Unclaimed completions live in the slabs, freed below.
+    if(jq->notify) {
+        close(jq->notifyFd[0]);
+        if(jq->notifyFd[1] != jq->notifyFd[0])
+            close(jq->notifyFd[1]);
+    }
+
     status = pthread_cond_destroy(&jq->wakeMain);
     if(status)
         ERR(status, "destroy wakeMain");
 
-    Job_free(jq->todo);
+    status = pthread_cond_destroy(&jq->wakeSubmitter);
+    if(status)
+        ERR(status, "destroy wakeSubmitter");
+
+    status = pthread_mutex_destroy(&jq->poolLock);
+    if(status)
+        ERR(status, "destroy poolLock");
+
+    while(jq->callers != NULL) {
+        CallerState *cs = jq->callers;
+        jq->callers = cs->next;
+        if(cs->state)
+            jq->ThreadState_free(cs->state);
+        Arena_free(&cs->arena);
+        free(cs);
+    }
+
+    // Job nodes, whether queued, cached, or free, all live in slabs.
+    while(jq->slabs != NULL) {
+        Slab *slab = jq->slabs;
+        jq->slabs = slab->next;
+        free(slab);
+    }
+    for(int i = 0; i < jq->nSlots; ++i)
+        Deque_free(jq->workers[i].deque);
+    free(jq->workers);
+    free(jq->stats);
+    free(jq->trace);
+    free(jq->heap);
     free(jq);
 }
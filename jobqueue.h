@@ -10,14 +10,175 @@
 #ifndef ARR_JOBQUEUE
 #  define ARR_JOBQUEUE
 
+#  include <stdbool.h>
+#  include <stddef.h>
+#  include <stdio.h>
+
+/// Number of priority levels, numbered 0 (lowest) and up
+#  define JOBQUEUE_NPRIORITY 4
+
+/// Number of bins in the histograms of JobStats. Bin 0 counts times
+/// of 0 ns; bin b > 0 counts times t with 2^(b-1) <= t < 2^b ns; the
+/// last bin also counts everything longer.
+#  define JOBQUEUE_HIST_BINS 40
+
+/// Most bytes of parameter that JobQueue_addJobCopy can store in a job
+#  define JOBQUEUE_INLINE_BYTES 48
+
+/// Most bytes of parameter that JobQueue_addJobMove can store in a job
+#  define JOBQUEUE_MOVE_BYTES 40
+
+/// Alignment of parameters stored in a job
+#  define JOBQUEUE_INLINE_ALIGN 16
+
+#  ifdef __cplusplus
+extern "C" {
+#  endif
+
 typedef struct JobQueue JobQueue;
+typedef struct JobHandle JobHandle;
+typedef struct JobGroup JobGroup;
+typedef struct CancelToken CancelToken;
+typedef struct JobPool JobPool;
+
+/// Order in which jobs on the shared queue are run
+typedef enum {
+    JOBQUEUE_LIFO,              // newest first
+    JOBQUEUE_FIFO               // oldest first
+} JobOrder;
+
+/// Statistics returned by JobQueue_getStats. Times are zero unless
+/// timing is on; see JobQueue_setTiming.
+typedef struct JobStats {
+    long        jobsRun;        // jobs executed (or discarded)
+    long        jobsStolen;     // taken from another worker's deque
+    long        parks;          // times a worker slept on a condvar
+    double      idleSeconds;    // time spent spinning or parked
+    double      lockSeconds;    // time spent waiting for the queue lock
+    double      runSeconds;     // time spent in jobfun
+    long        queued;         // jobs now on the shared queue (total only)
+    long        maxQueued;      // most ever on the shared queue (total only)
+    long        waitHist[JOBQUEUE_HIST_BINS];   // time from queue to start
+    long        runHist[JOBQUEUE_HIST_BINS];    // time in jobfun
+} JobStats;
+
+/// A finished job, as reported by JobQueue_completions
+typedef struct JobCompletion {
+    void       *param;          // job's param, or NULL if copied
+    int         status;         // value of jobfun, or ECANCELED
+} JobCompletion;
+
+/// How workers are placed on CPUs
+typedef enum {
+    JOBQUEUE_UNPINNED,          // let the scheduler decide
+    JOBQUEUE_COMPACT,           // fill one NUMA node, then the next
+    JOBQUEUE_SPREAD             // alternate among NUMA nodes
+} JobAffinity;
 
 JobQueue   *JobQueue_new(int nthreads, void *threadData,
                          void *(*ThreadState_new) (void *),
                          void (*ThreadState_free) (void *));
+void        JobQueue_setOrder(JobQueue * jq, JobOrder order);
+void        JobQueue_setWorkStealing(JobQueue * jq, bool on);
+void        JobQueue_setDeterministic(JobQueue * jq, bool on);
+JobPool    *JobPool_new(int nthreads);
+void        JobPool_free(JobPool * pool);
+void        JobQueue_setPool(JobQueue * jq, JobPool * pool, int weight);
+int         JobQueue_completionFd(JobQueue * jq);
+int         JobQueue_completions(JobQueue * jq, JobCompletion * done,
+                                 int max);
+void        JobQueue_setCallerHelps(JobQueue * jq, bool on);
+void        JobQueue_setInlineThreshold(JobQueue * jq, long backlog);
+void        JobQueue_setArenaSize(JobQueue * jq, size_t bytes);
+void       *JobQueue_scratch(size_t n);
+void        JobQueue_setAffinity(JobQueue * jq, JobAffinity policy);
+void        JobQueue_setCpuList(JobQueue * jq, int ncpu, const int *cpu);
+int         JobQueue_workerIndex(void);
+int         JobQueue_workerNode(void);
+void        JobQueue_prespawn(JobQueue * jq);
+void        JobQueue_setMaxThreads(JobQueue * jq, int n);
+void        JobQueue_setIdleTimeout(JobQueue * jq, double seconds,
+                                    int minThreads);
+int         JobQueue_threadCount(JobQueue * jq);
 void        JobQueue_addJob(JobQueue * jq,
                             int (*jobfun) (void *, void *), void *param);
+void        JobQueue_addJobCopy(JobQueue * jq,
+                                int (*jobfun) (void *, void *),
+                                const void *data, size_t size);
+void        JobQueue_addJobMove(JobQueue * jq,
+                                int (*jobfun) (void *, void *),
+                                void *data, size_t size,
+                                void (*move) (void *dst, void *src),
+                                void (*drop) (void *param));
+int         JobQueue_addJobTimed(JobQueue * jq,
+                                 int (*jobfun) (void *, void *),
+                                 void *param, double timeout);
+bool        JobQueue_tryAddJob(JobQueue * jq,
+                               int (*jobfun) (void *, void *), void *param);
+void        JobQueue_setCapacity(JobQueue * jq, long capacity,
+                                 long lowWater);
+void        JobQueue_addJobPriority(JobQueue * jq,
+                                    int (*jobfun) (void *, void *),
+                                    void *param, int priority,
+                                    double deadline);
+void        JobQueue_setAging(JobQueue * jq, double seconds);
+void        JobQueue_setSpin(JobQueue * jq, double seconds);
+void        JobQueue_queueLengths(JobQueue * jq,
+                                  long len[JOBQUEUE_NPRIORITY]);
+void        JobQueue_addJobs(JobQueue * jq,
+                             int (*jobfun) (void *, void *),
+                             void *base, size_t stride, long n);
+int         JobQueue_parallelFor(JobQueue * jq, long begin, long end,
+                                 long grain,
+                                 int (*fn) (void *ctx, long lo, long hi,
+                                            void *threadState),
+                                 void *ctx);
+JobHandle  *JobQueue_submit(JobQueue * jq,
+                            int (*jobfun) (void *, void *), void *param);
+int         JobHandle_wait(JobHandle * h);
+bool        JobHandle_poll(JobHandle * h, int *status);
+JobHandle  *JobHandle_then(JobHandle * h,
+                           int (*jobfun) (void *, void *), void *param);
+JobHandle  *JobQueue_addJobAfter(JobQueue * jq,
+                                 int (*jobfun) (void *, void *),
+                                 void *param, JobHandle ** deps,
+                                 int ndeps);
+void        JobHandle_free(JobHandle * h);
+JobGroup   *JobGroup_new(JobQueue * jq);
+void        JobGroup_add(JobGroup * g,
+                         int (*jobfun) (void *, void *), void *param);
+int         JobGroup_wait(JobGroup * g);
+long        JobGroup_errorCount(JobGroup * g);
+void        JobGroup_free(JobGroup * g);
+CancelToken *CancelToken_new(void);
+void        CancelToken_cancel(CancelToken * t);
+bool        CancelToken_cancelled(CancelToken * t);
+void        CancelToken_free(CancelToken * t);
+void        JobQueue_addJobCancelable(JobQueue * jq,
+                                      int (*jobfun) (void *, void *),
+                                      void *param, CancelToken * t,
+                                      double expiry);
+bool        JobQueue_jobCancelled(void);
+void        JobQueue_setErrorCallback(JobQueue * jq,
+                                      void (*onError) (void *errData,
+                                                       int status,
+                                                       void *param),
+                                      void *errData);
+void        JobQueue_setCancelOnError(JobQueue * jq, bool on);
+long        JobQueue_errorCount(JobQueue * jq);
+int         JobQueue_firstError(JobQueue * jq);
+long        JobQueue_discardCount(JobQueue * jq);
+void        JobQueue_clearErrors(JobQueue * jq);
+void        JobQueue_setTiming(JobQueue * jq, bool on);
+void        JobQueue_getStats(JobQueue * jq, JobStats * total,
+                              JobStats * perWorker);
+void        JobQueue_setTracing(JobQueue * jq, bool on);
+void        JobQueue_writeTrace(JobQueue * jq, FILE * fp);
 void        JobQueue_noMoreJobs(JobQueue * jq);
 void        JobQueue_waitOnJobs(JobQueue * jq);
 void        JobQueue_free(JobQueue * jq);
+
+#  ifdef __cplusplus
+}
+#  endif
 #endif
@@ -0,0 +1,287 @@
+/**
+ * @file jobqueue.hpp
+ * @author Alan R. Rogers
+ * @brief C++ interface to jobqueue.c
+ *
+ * jobqueue::Queue<TS> owns a JobQueue and accepts any callable as a
+ * job. A callable runs as f() or, if it accepts one, as f(ts), where
+ * ts is a TS& that belongs to the worker running it. Jobs may return
+ * an int status, as C jobs do, or void, which counts as 0.
+ *
+ * Callables are stored in the job node whenever they fit: those
+ * that can be copied byte for byte via JobQueue_addJobCopy, and
+ * others, move-only ones included, via JobQueue_addJobMove. Only
+ * callables that are too large, too strictly aligned, or that might
+ * throw while moving are put on the heap. A callable is destroyed
+ * once it has run, or when its job is discarded unrun.
+ *
+ * parallelFor, parallelForRange, and forEach pass the body's type to
+ * a template that becomes the C loop function, so the compiler can
+ * inline the body into the loop over each chunk.
+ *
+ * Jobs and loop bodies run beneath C frames, so they must not throw;
+ * an exception that escapes one terminates the program. For anything
+ * not wrapped here, get() returns the underlying JobQueue.
+ *
+ * @copyright Copyright (c) 2014, Alan R. Rogers
+ * <rogers@anthro.utah.edu>. This file is released under the Internet
+ * Systems Consortium License, which can be found in file "LICENSE".
+ */
+
+#ifndef ARR_JOBQUEUE_HPP
+#  define ARR_JOBQUEUE_HPP
+
+#  include "jobqueue.h"
+#  include <memory>
+#  include <new>
+#  include <type_traits>
+#  include <utility>
+
+namespace jobqueue {
+
+namespace detail {
+
+/// Turn the value of a job or loop body into an int status.
+template <class R> struct Status {
+    template <class F, class... A> static int call(F & f, A &&... a) {
+        return static_cast<int>(f(std::forward<A>(a)...));
+    }
+};
+
+template <> struct Status<void> {
+    template <class F, class... A> static int call(F & f, A &&... a) {
+        f(std::forward<A>(a)...);
+        return 0;
+    }
+};
+
+/// Call f(a..., *ts) if f accepts a thread state there.
+template <class F, class TS, class... A>
+inline auto apply(F & f, TS * ts, int, A &&... a)
+    -> decltype(f(std::forward<A>(a)..., *ts), int()) {
+    return Status<decltype(f(std::forward<A>(a)..., *ts))>::call(
+        f, std::forward<A>(a)..., *ts);
+}
+
+/// Otherwise call f(a...).
+template <class F, class TS, class... A>
+inline int apply(F & f, TS *, long, A &&... a) {
+    return Status<decltype(f(std::forward<A>(a)...))>::call(
+        f, std::forward<A>(a)...);
+}
+
+/// Job function for a callable of type Fn stored in the node
+template <class TS, class Fn> int runStored(void *param, void *ts) noexcept {
+    Fn & f = *static_cast<Fn *>(param);
+    int status = apply(f, static_cast<TS *>(ts), 0);
+    f.~Fn();
+    return status;
+}
+
+template <class Fn> void moveStored(void *dst, void *src) noexcept {
+    ::new(dst) Fn(std::move(*static_cast<Fn *>(src)));
+}
+
+template <class Fn> void dropStored(void *param) noexcept {
+    static_cast<Fn *>(param)->~Fn();
+}
+
+/// A callable too big for the node, kept on the heap
+template <class Fn> class Boxed {
+  public:
+    explicit Boxed(Fn * f) : f_(f) {}
+    template <class... A> auto operator()(A &&... a)
+        -> decltype(std::declval<Fn &>()(std::forward<A>(a)...)) {
+        return (*f_)(std::forward<A>(a)...);
+    }
+  private:
+    std::unique_ptr<Fn> f_;
+};
+
+/// How JobQueue_add stores a callable of type Fn
+template <class Fn> struct Storage {
+    static constexpr bool aligned = alignof(Fn) <= JOBQUEUE_INLINE_ALIGN;
+    static constexpr int value =
+        (std::is_trivially_copyable<Fn>::value && aligned
+         && sizeof(Fn) <= JOBQUEUE_INLINE_BYTES) ? 0       // copied
+        : (std::is_nothrow_move_constructible<Fn>::value && aligned
+           && sizeof(Fn) <= JOBQUEUE_MOVE_BYTES) ? 1        // moved
+        : 2;                    // boxed
+};
+
+/// Loop functions for JobQueue_parallelFor
+template <class TS, class B>
+int eachIndex(void *ctx, long lo, long hi, void *ts) noexcept {
+    B & body = *static_cast<B *>(ctx);
+    TS *state = static_cast<TS *>(ts);
+    for(long i = lo; i < hi; ++i) {
+        int status = apply(body, state, 0, i);
+        if(status)
+            return status;
+    }
+    return 0;
+}
+
+template <class TS, class B>
+int eachRange(void *ctx, long lo, long hi, void *ts) noexcept {
+    return apply(*static_cast<B *>(ctx), static_cast<TS *>(ts), 0, lo, hi);
+}
+
+template <class T, class B> struct Each {
+    T *first;
+    B *body;
+};
+
+template <class TS, class T, class B>
+int eachElement(void *ctx, long lo, long hi, void *ts) noexcept {
+    Each<T, B> & e = *static_cast<Each<T, B> *>(ctx);
+    TS *state = static_cast<TS *>(ts);
+    for(long i = lo; i < hi; ++i) {
+        int status = apply(*e.body, state, 0, e.first[i]);
+        if(status)
+            return status;
+    }
+    return 0;
+}
+
+/// Pointer to an object, as the void * that C callbacks take
+template <class T> void *opaque(T & x) {
+    return const_cast<void *>(static_cast<const void *>(std::addressof(x)));
+}
+
+/**
+ * Thread states of a queue. Each worker's TS is copied from a
+ * prototype that lives as long as the queue.
+ */
+template <class TS> class States {
+  protected:
+    States() : proto_() {}
+    template <class P> explicit States(P && proto)
+        : proto_(std::forward<P>(proto)) {}
+    JobQueue *make(int nthreads) {
+        return JobQueue_new(nthreads, &proto_, create, destroy);
+    }
+  private:
+    static void *create(void *proto) {
+        return new TS(*static_cast<const TS *>(proto));
+    }
+    static void destroy(void *ts) {
+        delete static_cast<TS *>(ts);
+    }
+    TS proto_;
+};
+
+template <> class States<void> {
+  protected:
+    JobQueue *make(int nthreads) {
+        return JobQueue_new(nthreads, nullptr, nullptr, nullptr);
+    }
+};
+
+}                               // namespace detail
+
+/// A JobQueue whose workers each have a thread state of type TS
+template <class TS = void> class Queue : private detail::States<TS> {
+  public:
+    /// Use at most nthreads workers. A TS is default-constructed.
+    explicit Queue(int nthreads) : jq_(this->make(nthreads)) {}
+
+    /// Likewise, but each worker's TS is a copy of proto.
+    template <class P, class T = TS,
+              class = typename std::enable_if<!std::is_void<T>::value
+                                              >::type>
+    Queue(int nthreads, P && proto)
+        : detail::States<TS>(std::forward<P>(proto)),
+        jq_(this->make(nthreads)) {}
+
+    Queue(const Queue &) = delete;
+    Queue & operator=(const Queue &) = delete;
+
+    /// Wait for all jobs, and free the queue.
+    ~Queue() {
+        JobQueue_free(jq_);
+    }
+
+    JobQueue *get() const {
+        return jq_;
+    }
+
+    /// Add a job that runs f() or f(ts); see the file comment.
+    template <class F> void add(F && f) {
+        using Fn = typename std::decay<F>::type;
+        store<Fn>(std::forward<F>(f),
+                  std::integral_constant<int, detail::Storage<Fn>::value>());
+    }
+
+    /**
+     * Call body(i) or body(i, ts) for each i in [begin, end), and
+     * wait. Return 0, or the first nonzero int returned by body. See
+     * JobQueue_parallelFor for grain.
+     */
+    template <class B> int parallelFor(long begin, long end, B && body,
+                                       long grain = 0) {
+        using Body = typename std::remove_reference<B>::type;
+        return JobQueue_parallelFor(jq_, begin, end, grain,
+                                    detail::eachIndex<TS, Body>,
+                                    detail::opaque(body));
+    }
+
+    /// Like parallelFor, but call body(lo, hi) or body(lo, hi, ts) on
+    /// whole chunks.
+    template <class B> int parallelForRange(long begin, long end, B && body,
+                                            long grain = 0) {
+        using Body = typename std::remove_reference<B>::type;
+        return JobQueue_parallelFor(jq_, begin, end, grain,
+                                    detail::eachRange<TS, Body>,
+                                    detail::opaque(body));
+    }
+
+    /// Call body(x) or body(x, ts) for each x of first[0..n-1], and
+    /// wait. Otherwise like parallelFor.
+    template <class T, class B> int forEach(T * first, long n, B && body,
+                                            long grain = 0) {
+        using Body = typename std::remove_reference<B>::type;
+        detail::Each<T, Body> e = { first, std::addressof(body) };
+        return JobQueue_parallelFor(jq_, 0, n, grain,
+                                    detail::eachElement<TS, T, Body>, &e);
+    }
+
+    /// Wait until all jobs have finished.
+    void wait() {
+        JobQueue_waitOnJobs(jq_);
+    }
+
+    long errorCount() const {
+        return JobQueue_errorCount(jq_);
+    }
+
+    int firstError() const {
+        return JobQueue_firstError(jq_);
+    }
+
+  private:
+    template <class Fn, class F>
+    void store(F && f, std::integral_constant<int, 0>) {
+        const Fn & copy = f;
+        JobQueue_addJobCopy(jq_, detail::runStored<TS, Fn>,
+                            std::addressof(copy), sizeof(Fn));
+    }
+
+    template <class Fn, class F>
+    void store(F && f, std::integral_constant<int, 1>) {
+        Fn tmp(std::forward<F>(f));
+        JobQueue_addJobMove(jq_, detail::runStored<TS, Fn>,
+                            std::addressof(tmp), sizeof(Fn),
+                            detail::moveStored<Fn>, detail::dropStored<Fn>);
+    }
+
+    template <class Fn, class F>
+    void store(F && f, std::integral_constant<int, 2>) {
+        add(detail::Boxed<Fn>(new Fn(std::forward<F>(f))));
+    }
+
+    JobQueue *jq_;
+};
+
+}                               // namespace jobqueue
+#endif
@@ -0,0 +1,277 @@
+/**
+ * @file jqbench.c
+ * @author Alan R. Rogers
+ * @brief Microbenchmarks for jobqueue.c.
+ *
+ * Each benchmark sweeps thread counts, job sizes, and, where it
+ * makes sense, the number of producer threads. Output is one
+ * tab-separated line per measurement, with a header line, so that
+ * runs from different builds can be compared. JobQueue_addJob, one
+ * job at a time, is the baseline against which the other submission
+ * paths are measured. The contention benchmark keeps idle workers
+ * spinning on the queue's shared fields while several producers
+ * submit empty jobs, which is where false sharing between those
+ * fields shows up; run it at 32 or more threads. The deterministic
+ * benchmark repeats the single-producer throughput runs with jobs
+ * dealt to workers in turn; compare it with the threads=1 lines.
+ *
+ * usage: jqbench [-q] [-t maxthreads]
+ *   -q  quick run, with fewer jobs and repetitions
+ *   -t  sweep thread counts up to maxthreads, rather than the number
+ *       of processors online
+ *
+ * @copyright Copyright (c) 2014, Alan R. Rogers
+ * <rogers@anthro.utah.edu>. This file is released under the Internet
+ * Systems Consortium License, which can be found in file "LICENSE".
+ */
+
+#include "jobqueue.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAXTHREADS 64
+#define MAXPRODUCERS 8
+
+static int64_t nowNs(void);
+static void burn(long ns);
+static void report(const char *bench, const char *variant, int nthreads,
+                   int nproducers, long work, long n, double seconds);
+static int sizes(int *nthreads, int max);
+
+/// Job that keeps a CPU busy for *(long *) param nanoseconds.
+static int workfun(void *param, void *tdat) {
+    burn(*(long *) param);
+    return 0;
+}
+
+/// Body of parallelFor: burn ctx nanoseconds per element.
+static int workrange(void *ctx, long lo, long hi, void *tdat) {
+    burn((hi - lo) * *(long *) ctx);
+    return 0;
+}
+
+static int64_t nowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/// Spin for ns nanoseconds.
+static void burn(long ns) {
+    if(ns <= 0)
+        return;
+    int64_t end = nowNs() + ns;
+    while(nowNs() < end) ;
+}
+
+/**
+ * Print one line of results. Rate is in operations per second, and
+ * cost in nanoseconds per operation.
+ */
+static void report(const char *bench, const char *variant, int nthreads,
+                   int nproducers, long work, long n, double seconds) {
+    printf("%s\t%s\t%d\t%d\t%ld\t%ld\t%.6f\t%.1f\t%.1f\n",
+           bench, variant, nthreads, nproducers, work, n, seconds,
+           n / seconds, 1e9 * seconds / n);
+    fflush(stdout);
+}
+
+/// Fill nthreads with 1, 2, 4, ... up to max. Return the count.
+static int sizes(int *nthreads, int max) {
+    int n = 0;
+    for(int t = 1; t <= max && t <= MAXTHREADS; t *= 2)
+        nthreads[n++] = t;
+    if(nthreads[n - 1] != max && max <= MAXTHREADS)
+        nthreads[n++] = max;
+    return n;
+}
+
+/// One producer thread's share of a throughput run
+typedef struct Producer {
+    JobQueue *jq;
+    long n;                     // jobs to submit
+    long *work;                 // job size, in ns
+    bool batch;                 // use JobQueue_addJobs
+    double seconds;             // time spent submitting
+} Producer;
+
+static void *producerfun(void *arg) {
+    Producer *p = (Producer *) arg;
+    int64_t t0 = nowNs();
+    if(p->batch)
+        JobQueue_addJobs(p->jq, workfun, p->work, 0, p->n);
+    else {
+        for(long i = 0; i < p->n; ++i)
+            JobQueue_addJob(p->jq, workfun, p->work);
+    }
+    p->seconds = 1e-9 * (nowNs() - t0);
+    return NULL;
+}
+
+/**
+ * Submit n jobs of the given size from nproducers threads, and wait
+ * for them. Report overall throughput and, separately, the cost of
+ * each submission as seen by a single producer.
+ */
+static void throughput(const char *bench, int nthreads, int nproducers,
+                       long work, long n, bool batch, double spinSeconds) {
+    pthread_t id[MAXPRODUCERS];
+    Producer prod[MAXPRODUCERS];
+    double submit = 0.0;
+    int i;
+
+    JobQueue *jq = JobQueue_new(nthreads, NULL, NULL, NULL);
+    if(spinSeconds >= 0.0)
+        JobQueue_setSpin(jq, spinSeconds);
+    if(strcmp(bench, "deterministic") == 0)
+        JobQueue_setDeterministic(jq, true);
+    JobQueue_prespawn(jq);
+
+    int64_t t0 = nowNs();
+    for(i = 0; i < nproducers; ++i) {
+        prod[i].jq = jq;
+        prod[i].n = n / nproducers;
+        prod[i].work = &work;
+        prod[i].batch = batch;
+        if(nproducers == 1)
+            producerfun(prod + i);
+        else if(pthread_create(id + i, NULL, producerfun, prod + i)) {
+            fprintf(stderr, "%s:%d: pthread_create failed\n",
+                    __FILE__, __LINE__);
+            exit(1);
+        }
+    }
+    if(nproducers > 1)
+        for(i = 0; i < nproducers; ++i)
+            pthread_join(id[i], NULL);
+    JobQueue_waitOnJobs(jq);
+    double seconds = 1e-9 * (nowNs() - t0);
+    for(i = 0; i < nproducers; ++i)
+        submit += prod[i].seconds;
+
+    const char *variant = batch ? "addJobs" : "addJob";
+    report(bench, variant, nthreads, nproducers, work,
+           nproducers * (n / nproducers), seconds);
+    // per producer: jobs each, and mean time
+    if(!batch && strcmp(bench, "throughput") == 0)
+        report("submit", variant, nthreads, nproducers, work,
+               n / nproducers, submit / nproducers);
+    JobQueue_free(jq);
+}
+
+/// Job that records when it started.
+static int stampfun(void *param, void *tdat) {
+    *(int64_t *) param = nowNs();
+    return 0;
+}
+
+/**
+ * Time from submitting a single job to an idle pool until the job
+ * starts. Between trials the workers are left idle long enough to
+ * finish spinning and park, unless spinSeconds exceeds the gap.
+ */
+static void wakeup(int nthreads, double spinSeconds, long reps) {
+    struct timespec gap = {.tv_sec = 0,.tv_nsec = 200000L };
+    double total = 0.0;
+    int64_t started;
+
+    JobQueue *jq = JobQueue_new(nthreads, NULL, NULL, NULL);
+    JobQueue_setSpin(jq, spinSeconds);
+    JobQueue_prespawn(jq);
+    for(long i = 0; i < reps; ++i) {
+        nanosleep(&gap, NULL);
+        int64_t t0 = nowNs();
+        JobQueue_addJob(jq, stampfun, &started);
+        JobQueue_waitOnJobs(jq);
+        total += 1e-9 * (started - t0);
+    }
+    report("wakeup", spinSeconds > 0.0 ? "spin" : "park", nthreads, 1,
+           0, reps, total);
+    JobQueue_free(jq);
+}
+
+/// parallelFor over n elements of work ns each.
+static void parfor(int nthreads, long work, long n) {
+    JobQueue *jq = JobQueue_new(nthreads, NULL, NULL, NULL);
+    JobQueue_prespawn(jq);
+    int64_t t0 = nowNs();
+    int status = JobQueue_parallelFor(jq, 0, n, 0, workrange, &work);
+    double seconds = 1e-9 * (nowNs() - t0);
+    assert(status == 0);
+    report("parallelFor", "auto", nthreads, 1, work, n, seconds);
+    JobQueue_free(jq);
+}
+
+int main(int argc, char **argv) {
+    int quick = 0;
+    int nthreads[MAXTHREADS], ntsizes, maxthreads, i, j, k;
+    long work[] = { 0, 1000, 10000 };
+    int nwork = sizeof(work) / sizeof(work[0]);
+    int producers[] = { 1, 2, 4 };
+    int nproducers = sizeof(producers) / sizeof(producers[0]);
+
+    maxthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    for(i = 1; i < argc; ++i) {
+        if(strcmp(argv[i], "-q") == 0)
+            quick = 1;
+        else if(strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+            maxthreads = atoi(argv[++i]);
+        else {
+            fprintf(stderr, "usage: jqbench [-q] [-t maxthreads]\n");
+            exit(1);
+        }
+    }
+
+    long njobs = quick ? 20000 : 200000;
+    long nwake = quick ? 200 : 2000;
+    long nrange = quick ? 20000 : 200000;
+
+    if(maxthreads < 1)
+        maxthreads = 1;
+    if(maxthreads > MAXTHREADS)
+        maxthreads = MAXTHREADS;
+    ntsizes = sizes(nthreads, maxthreads);
+
+    printf("bench\tvariant\tthreads\tproducers\twork_ns\tn"
+           "\tseconds\tper_sec\tns_per_op\n");
+
+    for(i = 0; i < ntsizes; ++i) {
+        for(j = 0; j < nwork; ++j) {
+            long n = (work[j] > 0 ? njobs / (1 + work[j] / 1000) : njobs);
+            for(k = 0; k < nproducers; ++k) {
+                throughput("throughput", nthreads[i], producers[k],
+                           work[j], n, false, -1.0);
+            }
+            throughput("throughput", nthreads[i], 1, work[j], n, true,
+                       -1.0);
+        }
+    }
+
+    for(i = 0; i < ntsizes; ++i)
+        for(j = 0; j < nwork; ++j) {
+            long n = (work[j] > 0 ? njobs / (1 + work[j] / 1000) : njobs);
+            throughput("deterministic", nthreads[i], 1, work[j], n, false,
+                       -1.0);
+        }
+
+    for(i = 0; i < ntsizes; ++i)
+        throughput("contend", nthreads[i], MAXPRODUCERS, 0, njobs, false,
+                   1e-3);
+
+    for(i = 0; i < ntsizes; ++i) {
+        wakeup(nthreads[i], 0.0, nwake);
+        wakeup(nthreads[i], 1e-3, nwake);
+    }
+
+    for(i = 0; i < ntsizes; ++i)
+        for(j = 0; j < nwork; ++j)
+            parfor(nthreads[i], work[j] / 10, nrange);
+
+    return 0;
+}
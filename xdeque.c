@@ -0,0 +1,157 @@
+/**
+ * @file xdeque.c
+ * @author Alan R. Rogers
+ * @brief Test deque.c.
+ * @copyright Copyright (c) 2014, Alan R. Rogers
+ * <rogers@anthro.utah.edu>. This file is released under the Internet
+ * Systems Consortium License, which can be found in file "LICENSE".
+ */
+
+#include "deque.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+
+#ifdef NDEBUG
+#error "Unit tests must be compiled without -DNDEBUG flag"
+#endif
+
+#define NITEMS 100000
+#define NTHIEVES 3
+
+static void unitTstResult(const char *facility, const char *result);
+static void *thief(void *arg);
+
+static Deque *dq;
+static long items[NITEMS];
+static int taken[NITEMS];       // number of times each item was taken
+static int done;                // set when owner has finished
+
+static void unitTstResult(const char *facility, const char *result) {
+    printf("%-26s %s\n", facility, result);
+}
+
+static void *thief(void *arg) {
+    long *nstolen = (long *) arg;
+    for(;;) {
+        void *p = Deque_steal(dq);
+        if(p == DEQUE_ABORT)
+            continue;
+        if(p == NULL) {
+            if(__atomic_load_n(&done, __ATOMIC_ACQUIRE))
+                break;
+            continue;
+        }
+        long *ip = (long *) p;
+        __atomic_add_fetch(&taken[*ip], 1, __ATOMIC_RELAXED);
+        ++*nstolen;
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+
+    int verbose = 0;
+
+    switch (argc) {
+    case 1:
+        break;
+    case 2:
+        if(strncmp(argv[1], "-v", 2) != 0) {
+            fprintf(stderr, "usage: xdeque [-v]\n");
+            exit(1);
+        }
+        verbose = 1;
+        break;
+    default:
+        fprintf(stderr, "usage: xdeque [-v]\n");
+        exit(1);
+    }
+
+    long i;
+    int a = 1, b = 2, c = 3;
+
+    // single-threaded: LIFO at bottom, FIFO at top
+    dq = Deque_new(3);
+    assert(Deque_empty(dq));
+    assert(Deque_pop(dq) == NULL);
+    assert(Deque_steal(dq) == NULL);
+    assert(Deque_push(dq, &a));
+    assert(Deque_push(dq, &b));
+    assert(Deque_push(dq, &c));
+    assert(!Deque_empty(dq));
+    assert(Deque_pop(dq) == &c);
+    assert(Deque_steal(dq) == &a);
+    assert(Deque_pop(dq) == &b);
+    assert(Deque_pop(dq) == NULL);
+    assert(Deque_empty(dq));
+
+    // capacity was rounded up to 4
+    for(i = 0; i < 4; ++i)
+        assert(Deque_push(dq, &a));
+    assert(!Deque_push(dq, &a));
+    for(i = 0; i < 4; ++i)
+        assert(Deque_pop(dq) == &a);
+    Deque_free(dq);
+
+    // concurrent: every item is taken exactly once
+    pthread_t id[NTHIEVES];
+    long nstolen[NTHIEVES];
+    long npopped = 0;
+    dq = Deque_new(256);
+    for(i = 0; i < NTHIEVES; ++i) {
+        nstolen[i] = 0;
+        if(pthread_create(id + i, NULL, thief, nstolen + i)) {
+            fprintf(stderr, "%s:%d: pthread_create failed\n",
+                    __FILE__, __LINE__);
+            exit(1);
+        }
+    }
+    for(i = 0; i < NITEMS; ++i) {
+        items[i] = i;
+        while(!Deque_push(dq, items + i)) {
+            long *ip = Deque_pop(dq);
+            if(ip) {
+                ++taken[*ip];
+                ++npopped;
+            }
+        }
+        if(i % 3 == 0) {
+            long *ip = Deque_pop(dq);
+            if(ip) {
+                ++taken[*ip];
+                ++npopped;
+            }
+        }
+    }
+    for(;;) {
+        long *ip = Deque_pop(dq);
+        if(ip == NULL)
+            break;
+        ++taken[*ip];
+        ++npopped;
+    }
+    __atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+    for(i = 0; i < NTHIEVES; ++i)
+        pthread_join(id[i], NULL);
+
+    long total = npopped;
+    for(i = 0; i < NTHIEVES; ++i)
+        total += nstolen[i];
+    if(verbose) {
+        printf("popped=%ld", npopped);
+        for(i = 0; i < NTHIEVES; ++i)
+            printf(" stolen[%ld]=%ld", i, nstolen[i]);
+        putchar('\n');
+    }
+    assert(total == NITEMS);
+    for(i = 0; i < NITEMS; ++i)
+        assert(taken[i] == 1);
+    assert(Deque_empty(dq));
+    Deque_free(dq);
+
+    unitTstResult("Deque", "OK");
+    return 0;
+}
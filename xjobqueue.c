@@ -8,11 +8,19 @@
  * Systems Consortium License, which can be found in file "LICENSE".
  */
 
+#define _GNU_SOURCE             // for sched_getcpu
 #include "jobqueue.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <poll.h>
 #include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/wait.h>
 
 #ifdef NDEBUG
 #error "Unit tests must be compiled without -DNDEBUG flag"
@@ -26,6 +34,13 @@ typedef struct {
     int i;
 } ThreadState;
 
+/// A node in a binary tree of nested jobs.
+typedef struct {
+    JobQueue *jq;
+    int depth;
+    long *nleaves;
+} TreeParam;
+
 void *ThreadState_new(void *dat);
 void ThreadState_free(void *self);
 static void unitTstResult(const char *facility, const char *result);
@@ -34,7 +49,12 @@ static void unitTstResult(const char *facility, const char *result) {
     printf("%-26s %s\n", facility, result);
 }
 
+/// Number of ThreadState objects constructed and destroyed
+static int nStates = 0;
+static int nFreed = 0;
+
 void *ThreadState_new(void *dat) {
+    __atomic_add_fetch(&nStates, 1, __ATOMIC_RELAXED);
     ThreadState *ts = malloc(sizeof *ts);
     if(ts == NULL) {
         fprintf(stderr, "%s:%d: bad malloc\n", __FILE__, __LINE__);
@@ -47,6 +67,7 @@ void *ThreadState_new(void *dat) {
 }
 
 void ThreadState_free(void *self) {
+    __atomic_add_fetch(&nFreed, 1, __ATOMIC_RELAXED);
     free(self);
 }
 
@@ -61,6 +82,441 @@ int jobfunc(void *p, void *tdat) {
     return 0;
 }
 
+int treefunc(void *p, void *tdat);
+
+/// Submit two children from within a running job, until depth is 0.
+int treefunc(void *p, void *tdat) {
+    TreeParam *param = (TreeParam *) p;
+
+    if(param->depth == 0) {
+        __atomic_add_fetch(param->nleaves, 1, __ATOMIC_RELAXED);
+        free(param);
+        return 0;
+    }
+
+    for(int i = 0; i < 2; ++i) {
+        TreeParam *child = malloc(sizeof *child);
+        assert(child);
+        *child = *param;
+        --child->depth;
+        JobQueue_addJob(param->jq, treefunc, child);
+    }
+    free(param);
+    return 0;
+}
+
+int rangefunc(void *ctx, long lo, long hi, void *tdat);
+
+/// Set x[i] = i * multiplier for i in [lo, hi). Fail if the range
+/// includes a negative entry of x.
+int rangefunc(void *ctx, long lo, long hi, void *tdat) {
+    long *x = (long *) ctx;
+    ThreadState *ts = (ThreadState *) tdat;
+
+    for(long i = lo; i < hi; ++i) {
+        if(x[i] < 0)
+            return 7;
+        x[i] = i * ts->i;
+    }
+    return 0;
+}
+
+/// Records the order in which jobs run
+typedef struct {
+    int *log;
+    int *nlogged;
+    int id;
+} OrderParam;
+
+int orderfunc(void *p, void *tdat);
+
+int orderfunc(void *p, void *tdat) {
+    OrderParam *param = (OrderParam *) p;
+    int k = __atomic_fetch_add(param->nlogged, 1, __ATOMIC_RELAXED);
+    param->log[k] = param->id;
+    return 0;
+}
+
+/// Holds a worker until told to go
+typedef struct {
+    int running, go;
+} Gate;
+
+int gatefunc(void *p, void *tdat);
+static void Gate_wait(Gate * gate);
+
+int gatefunc(void *p, void *tdat) {
+    Gate *gate = (Gate *) p;
+    __atomic_store_n(&gate->running, 1, __ATOMIC_RELEASE);
+    while(!__atomic_load_n(&gate->go, __ATOMIC_ACQUIRE))
+        sched_yield();
+    return 0;
+}
+
+/// Wait until gatefunc is running.
+static void Gate_wait(Gate * gate) {
+    while(!__atomic_load_n(&gate->running, __ATOMIC_ACQUIRE))
+        sched_yield();
+}
+
+/// Records which worker ran it, then opens a gate
+typedef struct {
+    int index;
+    Gate *gate;
+} Opener;
+
+int openfunc(void *p, void *tdat);
+
+int openfunc(void *p, void *tdat) {
+    Opener *op = (Opener *) p;
+    op->index = JobQueue_workerIndex();
+    if(op->gate)
+        __atomic_store_n(&op->gate->go, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static int waitForThreads(JobQueue * jq, int n);
+
+/// Wait up to 5 s for the pool to have n threads. Return 1 on success.
+static int waitForThreads(JobQueue * jq, int n) {
+    struct timespec ms = {.tv_sec = 0,.tv_nsec = 1000000L };
+    for(int i = 0; i < 5000; ++i) {
+        if(JobQueue_threadCount(jq) == n)
+            return 1;
+        nanosleep(&ms, NULL);
+    }
+    return 0;
+}
+
+int statusfunc(void *p, void *tdat);
+int doublefunc(void *p, void *tdat);
+
+/// Return the integer pointed to by p.
+int statusfunc(void *p, void *tdat) {
+    return *(int *) p;
+}
+
+/// Double the integer pointed to by p.
+int doublefunc(void *p, void *tdat) {
+    *(int *) p *= 2;
+    return 0;
+}
+
+/// Where a job ran
+typedef struct Place {
+    int index, node, cpu, initCpu;
+} Place;
+
+void *PinState_new(void *dat);
+int placefunc(void *p, void *tdat);
+
+/// Thread state that records the CPU on which it was constructed.
+void *PinState_new(void *dat) {
+    int *cpu = malloc(sizeof *cpu);
+    assert(cpu);
+    *cpu = sched_getcpu();
+    return cpu;
+}
+
+/// Record the worker, node, and CPU running this job.
+int placefunc(void *p, void *tdat) {
+    Place *place = (Place *) p;
+    place->index = JobQueue_workerIndex();
+    place->node = JobQueue_workerNode();
+    place->cpu = sched_getcpu();
+    place->initCpu = *(int *) tdat;
+    return 0;
+}
+
+int countfunc(void *p, void *tdat);
+void *producerfun(void *arg);
+
+/// Atomically increment the long pointed to by p.
+int countfunc(void *p, void *tdat) {
+    __atomic_add_fetch((long *) p, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/// A thread submitting jobs concurrently with others
+typedef struct Producer {
+    JobQueue *jq;
+    long n;                     // jobs to submit
+    long *count;                // incremented by each job
+} Producer;
+
+void *producerfun(void *arg) {
+    Producer *p = (Producer *) arg;
+    for(long i = 0; i < p->n; ++i) {
+        if(i % 100 == 0)
+            JobQueue_addJobPriority(p->jq, countfunc, p->count, 1, 0.0);
+        else
+            JobQueue_addJob(p->jq, countfunc, p->count);
+    }
+    return NULL;
+}
+
+int pollfunc(void *p, void *tdat);
+int spawnfunc(void *p, void *tdat);
+
+/// Run until cancelled, then say so.
+int pollfunc(void *p, void *tdat) {
+    int *flag = (int *) p;
+    __atomic_store_n(flag, 1, __ATOMIC_RELEASE);
+    while(!JobQueue_jobCancelled())
+        sched_yield();
+    __atomic_store_n(flag, 2, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/// A parent that cancels its own token, then submits a child.
+typedef struct {
+    JobQueue *jq;
+    CancelToken *token;
+    long *count;
+} Spawner;
+
+int spawnfunc(void *p, void *tdat) {
+    Spawner *sp = (Spawner *) p;
+    CancelToken_cancel(sp->token);
+    JobQueue_addJob(sp->jq, countfunc, sp->count);
+    return 0;
+}
+
+void *Rng_new(void *notused);
+int drawfunc(void *p, void *tdat);
+
+/// A random number generator for each worker, seeded by its index
+void *Rng_new(void *notused) {
+    unsigned long *rng = malloc(sizeof(unsigned long));
+    assert(rng);
+    *rng = 1 + JobQueue_workerIndex();
+    return rng;
+}
+
+/// Record the worker and a draw from its generator.
+typedef struct {
+    int worker;
+    unsigned long draw;
+} Draw;
+
+int drawfunc(void *p, void *tdat) {
+    Draw *d = (Draw *) p;
+    unsigned long *rng = (unsigned long *) tdat;
+    *rng = *rng * 6364136223846793005UL + 1442695040888963407UL;
+    d->worker = JobQueue_workerIndex();
+    d->draw = *rng;
+    return 0;
+}
+
+int memberfunc(void *p, void *tdat);
+int slowdoublefunc(void *p, void *tdat);
+int crossfunc(void *p, void *tdat);
+
+/// A job in a shared pool: log its tag, and track how many such jobs
+/// run at once, while keeping the CPU busy for 300 us.
+typedef struct {
+    int tag;
+    int *log, *nlog;
+    int *live, *maxLive;
+} Member;
+
+int memberfunc(void *p, void *tdat) {
+    Member *m = (Member *) p;
+    struct timespec t0, t;
+    int n = __atomic_add_fetch(m->live, 1, __ATOMIC_SEQ_CST);
+    int mx = __atomic_load_n(m->maxLive, __ATOMIC_RELAXED);
+    while(n > mx && !__atomic_compare_exchange_n(m->maxLive, &mx, n, true,
+                                                 __ATOMIC_RELAXED,
+                                                 __ATOMIC_RELAXED)) ;
+    m->log[__atomic_fetch_add(m->nlog, 1, __ATOMIC_RELAXED)] = m->tag;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    do {
+        clock_gettime(CLOCK_MONOTONIC, &t);
+    } while((t.tv_sec - t0.tv_sec) * 1000000000L
+            + (t.tv_nsec - t0.tv_nsec) < 300000L);
+    __atomic_sub_fetch(m->live, 1, __ATOMIC_SEQ_CST);
+    return 0;
+}
+
+/// Double an integer after 5 ms.
+int slowdoublefunc(void *p, void *tdat) {
+    struct timespec t = {.tv_sec = 0,.tv_nsec = 5000000L };
+    nanosleep(&t, NULL);
+    return doublefunc(p, tdat);
+}
+
+/// Slowly double an integer on another queue, and wait for it.
+typedef struct {
+    JobQueue *other;
+    int x;
+    int submitted;              // set once the job is on other
+} Cross;
+
+int crossfunc(void *p, void *tdat) {
+    Cross *c = (Cross *) p;
+    JobHandle *h = JobQueue_submit(c->other, slowdoublefunc, &c->x);
+    __atomic_store_n(&c->submitted, 1, __ATOMIC_RELEASE);
+    int status = JobHandle_wait(h);
+    JobHandle_free(h);
+    return status;
+}
+
+int splitfunc(void *p, void *tdat);
+int sumrange(void *ctx, long lo, long hi, void *tdat);
+int waitfunc(void *p, void *tdat);
+
+/// Sum lo..hi-1 by divide and conquer, waiting on a handle or group.
+typedef struct {
+    JobQueue *jq;
+    bool group;
+    long lo, hi, sum;
+} Split;
+
+int splitfunc(void *p, void *tdat) {
+    Split *sp = (Split *) p;
+    if(sp->hi - sp->lo <= 8) {
+        sp->sum = 0;
+        for(long i = sp->lo; i < sp->hi; ++i)
+            sp->sum += i;
+        return 0;
+    }
+    long mid = sp->lo + (sp->hi - sp->lo) / 2;
+    Split left = *sp, right = *sp;
+    left.hi = right.lo = mid;
+    if(sp->group) {
+        JobGroup *g = JobGroup_new(sp->jq);
+        JobGroup_add(g, splitfunc, &left);
+        JobGroup_add(g, splitfunc, &right);
+        assert(0 == JobGroup_wait(g));
+        JobGroup_free(g);
+    } else {
+        JobHandle *h = JobQueue_submit(sp->jq, splitfunc, &left);
+        splitfunc(&right, tdat);
+        assert(0 == JobHandle_wait(h));
+        JobHandle_free(h);
+    }
+    sp->sum = left.sum + right.sum;
+    return 0;
+}
+
+/// Add lo..hi-1 to *(long *) ctx.
+int sumrange(void *ctx, long lo, long hi, void *tdat) {
+    long s = 0;
+    for(long i = lo; i < hi; ++i)
+        s += i;
+    __atomic_add_fetch((long *) ctx, s, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/// From inside a job: a parallel for, then a batch of jobs and a
+/// wait for the whole queue.
+int waitfunc(void *p, void *tdat) {
+    Split *sp = (Split *) p;
+    long count = 0;
+    sp->sum = 0;
+    assert(0 == JobQueue_parallelFor(sp->jq, sp->lo, sp->hi, 0, sumrange,
+                                     &sp->sum));
+    for(int i = 0; i < 100; ++i)
+        JobQueue_addJob(sp->jq, countfunc, &count);
+    JobQueue_waitOnJobs(sp->jq);
+    assert(count == 100);
+    return 0;
+}
+
+int timedfunc(void *p, void *tdat);
+
+/// From a job, fill the queue, then make a timed add, which runs the
+/// job on the spot.
+typedef struct {
+    JobQueue *jq;
+    long count;
+    int status;
+    bool ranHere;
+} Timed;
+
+int timedfunc(void *p, void *tdat) {
+    Timed *t = (Timed *) p;
+    assert(JobQueue_tryAddJob(t->jq, countfunc, &t->count));
+    assert(!JobQueue_tryAddJob(t->jq, countfunc, &t->count));
+    t->status = JobQueue_addJobTimed(t->jq, countfunc, &t->count, 1.0);
+    t->ranHere = (__atomic_load_n(&t->count, __ATOMIC_RELAXED) == 1);
+    return 0;
+}
+
+int napfunc(void *p, void *tdat);
+int outerfunc(void *p, void *tdat);
+
+/// Sleep 5 ms, then count ourselves done.
+int napfunc(void *p, void *tdat) {
+    struct timespec t = {.tv_sec = 0,.tv_nsec = 5000000L };
+    nanosleep(&t, NULL);
+    __atomic_add_fetch((int *) p, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/// Submit children that sleep, and wait for the whole queue. Each of
+/// several such jobs must see its own children finished.
+typedef struct {
+    JobQueue *jq;
+    int done, seen;
+} Outer;
+
+int outerfunc(void *p, void *tdat) {
+    Outer *o = (Outer *) p;
+    for(int i = 0; i < 5; ++i)
+        JobQueue_addJob(o->jq, napfunc, &o->done);
+    JobQueue_waitOnJobs(o->jq);
+    o->seen = __atomic_load_n(&o->done, __ATOMIC_RELAXED);
+    return 0;
+}
+
+int copyfunc(void *p, void *tdat);
+
+/// Parameter copied into the job: add the sum of v to *sum.
+typedef struct {
+    long *sum;
+    long v[JOBQUEUE_INLINE_BYTES / sizeof(long) - 1];
+} Copied;
+
+int copyfunc(void *p, void *tdat) {
+    Copied *c = (Copied *) p;
+    long s = 0;
+    for(size_t i = 0; i < sizeof(c->v) / sizeof(c->v[0]); ++i)
+        s += c->v[i];
+    __atomic_add_fetch(c->sum, s, __ATOMIC_RELAXED);
+    return 0;
+}
+
+int scratchfunc(void *p, void *tdat);
+
+/// Take k blocks of n bytes of scratch memory, and fill them.
+typedef struct {
+    size_t n;
+    int k;
+    char *first;                // first block
+} Scratch;
+
+int scratchfunc(void *p, void *tdat) {
+    Scratch *sc = (Scratch *) p;
+    for(int i = 0; i < sc->k; ++i) {
+        char *mem = JobQueue_scratch(sc->n);
+        assert(mem != NULL);
+        assert(((size_t) mem) % 16 == 0);
+        memset(mem, i, sc->n);
+        if(i == 0)
+            sc->first = mem;
+    }
+    return 0;
+}
+
+void errfunc(void *errData, int status, void *param);
+
+/// Error callback: count calls and check the status.
+void errfunc(void *errData, int status, void *param) {
+    assert(status == *(int *) param);
+    __atomic_add_fetch((int *) errData, 1, __ATOMIC_RELAXED);
+}
+
 int main(int argc, char **argv) {
 
     int verbose = 0;
@@ -122,6 +578,923 @@ int main(int argc, char **argv) {
     }
 
     JobQueue_free(jq);
+
+    // bulk submission
+    jq = JobQueue_new(nthreads, &multiplier, ThreadState_new,
+                      ThreadState_free);
+    for(i = 0; i < njobs; ++i) {
+        jobs[i].arg = i + 21.0;
+        jobs[i].result = -99.0;
+    }
+    JobQueue_addJobs(jq, jobfunc, jobs, sizeof(jobs[0]), njobs);
+
+    // a batch larger than one slab of Job nodes
+    int nbig = 1000;
+    TstParam *big = malloc(nbig * sizeof(big[0]));
+    assert(big);
+    for(i = 0; i < nbig; ++i) {
+        big[i].arg = i;
+        big[i].result = -99.0;
+    }
+    JobQueue_addJobs(jq, jobfunc, big, sizeof(big[0]), nbig);
+    JobQueue_waitOnJobs(jq);
+    for(i = 0; i < nbig; ++i)
+        assert(big[i].result == i * multiplier);
+    free(big);
+
+    // parallel for, with fixed and automatic grain
+    long nrange = 100000, grain;
+    long *x = malloc(nrange * sizeof(x[0]));
+    assert(x);
+    for(grain = 1000; grain >= 0; grain -= 1000) {
+        memset(x, 0, nrange * sizeof(x[0]));
+        assert(0 == JobQueue_parallelFor(jq, 0, nrange, grain,
+                                         rangefunc, x));
+        for(long j = 0; j < nrange; ++j)
+            assert(x[j] == j * multiplier);
+    }
+    memset(x, 0, nrange * sizeof(x[0]));
+    x[nrange / 2] = -1;
+    assert(7 == JobQueue_parallelFor(jq, 0, nrange, 0, rangefunc, x));
+    assert(0 == JobQueue_parallelFor(jq, 5, 5, 0, rangefunc, x));
+
+    for(i = 0; i < njobs; ++i)
+        assert(jobs[i].result == (i + 21.0) * multiplier);
+
+    JobQueue_free(jq);
+
+    // work-stealing mode, with jobs submitted from within jobs
+    int depth = 12;
+    long nleaves = 0;
+    jq = JobQueue_new(nthreads, &multiplier, ThreadState_new,
+                      ThreadState_free);
+    JobQueue_setWorkStealing(jq, true);
+    TreeParam *root = malloc(sizeof *root);
+    assert(root);
+    root->jq = jq;
+    root->depth = depth;
+    root->nleaves = &nleaves;
+    JobQueue_addJob(jq, treefunc, root);
+    JobQueue_waitOnJobs(jq);
+    if(verbose)
+        printf("work stealing: %ld leaves\n", nleaves);
+    assert(nleaves == 1L << depth);
+
+    memset(x, 0, nrange * sizeof(x[0]));
+    assert(0 == JobQueue_parallelFor(jq, 0, nrange, 0, rangefunc, x));
+    for(long j = 0; j < nrange; ++j)
+        assert(x[j] == j * multiplier);
+    free(x);
+    JobQueue_free(jq);
+
+    // FIFO order: with a single worker, jobs run in order of
+    // submission, whether added one at a time or in bulk.
+    int norder = 2 * njobs, nlogged = 0, log[norder];
+    OrderParam op[norder];
+    jq = JobQueue_new(1, &multiplier, ThreadState_new, ThreadState_free);
+    JobQueue_setOrder(jq, JOBQUEUE_FIFO);
+    for(i = 0; i < norder; ++i) {
+        op[i].log = log;
+        op[i].nlogged = &nlogged;
+        op[i].id = i;
+    }
+    for(i = 0; i < njobs; ++i)
+        JobQueue_addJob(jq, orderfunc, op + i);
+    JobQueue_addJobs(jq, orderfunc, op + njobs, sizeof(op[0]), njobs);
+    JobQueue_waitOnJobs(jq);
+    assert(nlogged == norder);
+    for(i = 0; i < norder; ++i)
+        assert(log[i] == i);
+    JobQueue_free(jq);
+
+    // Priorities: while the only worker is held at the gate, queue
+    // jobs at each priority, lowest first. They run highest first,
+    // except the one whose deadline is due, which runs before all.
+    Gate gate = {0, 0};
+    long len[JOBQUEUE_NPRIORITY];
+    nlogged = 0;
+    jq = JobQueue_new(1, &multiplier, ThreadState_new, ThreadState_free);
+    JobQueue_setOrder(jq, JOBQUEUE_FIFO);
+    JobQueue_setAging(jq, 0.0);
+    JobQueue_addJob(jq, gatefunc, &gate);
+    Gate_wait(&gate);
+    for(i = 0; i < JOBQUEUE_NPRIORITY; ++i)
+        JobQueue_addJobPriority(jq, orderfunc, op + i, i, 0.0);
+    JobQueue_addJobPriority(jq, orderfunc, op + JOBQUEUE_NPRIORITY, 0,
+                            1e-9);
+    JobQueue_queueLengths(jq, len);
+    assert(len[0] == 2);
+    for(i = 1; i < JOBQUEUE_NPRIORITY; ++i)
+        assert(len[i] == 1);
+    __atomic_store_n(&gate.go, 1, __ATOMIC_RELEASE);
+    JobQueue_waitOnJobs(jq);
+    assert(nlogged == JOBQUEUE_NPRIORITY + 1);
+    assert(log[0] == JOBQUEUE_NPRIORITY);
+    for(i = 0; i < JOBQUEUE_NPRIORITY; ++i)
+        assert(log[i + 1] == JOBQUEUE_NPRIORITY - 1 - i);
+    JobQueue_queueLengths(jq, len);
+    for(i = 0; i < JOBQUEUE_NPRIORITY; ++i)
+        assert(len[i] == 0);
+
+    // Aging: a low-priority job that has waited long enough runs
+    // before a fresh high-priority one.
+    struct timespec pause = {.tv_sec = 0,.tv_nsec = 20000000L };
+    gate.running = gate.go = 0;
+    nlogged = 0;
+    JobQueue_setAging(jq, 0.002);
+    JobQueue_addJob(jq, gatefunc, &gate);
+    Gate_wait(&gate);
+    JobQueue_addJobPriority(jq, orderfunc, op + 0, 0, 0.0);
+    nanosleep(&pause, NULL);
+    JobQueue_addJobPriority(jq, orderfunc, op + 1,
+                            JOBQUEUE_NPRIORITY - 1, 0.0);
+    __atomic_store_n(&gate.go, 1, __ATOMIC_RELEASE);
+    JobQueue_waitOnJobs(jq);
+    assert(nlogged == 2);
+    assert(log[0] == 0 && log[1] == 1);
+    JobQueue_free(jq);
+
+    // Completion handles: wait, poll, and chain
+    jq = JobQueue_new(nthreads, &multiplier, ThreadState_new,
+                      ThreadState_free);
+    int codes[njobs], val = 5, st;
+    JobHandle *h[njobs];
+    for(i = 0; i < njobs; ++i) {
+        codes[i] = 100 + i;
+        h[i] = JobQueue_submit(jq, statusfunc, codes + i);
+    }
+    for(i = njobs - 1; i >= 0; --i)
+        assert(JobHandle_wait(h[i]) == 100 + i);
+    for(i = 0; i < njobs; ++i) {
+        assert(JobHandle_poll(h[i], &st));
+        assert(st == 100 + i);
+        JobHandle_free(h[i]);
+    }
+
+    gate.running = gate.go = 0;
+    JobHandle *hg = JobQueue_submit(jq, gatefunc, &gate);
+    JobHandle *h1 = JobHandle_then(hg, doublefunc, &val);
+    JobHandle *h2 = JobHandle_then(h1, doublefunc, &val);
+    Gate_wait(&gate);
+    assert(!JobHandle_poll(h2, NULL));
+    __atomic_store_n(&gate.go, 1, __ATOMIC_RELEASE);
+    assert(JobHandle_wait(h2) == 0);
+    assert(val == 20);
+    JobHandle *h3 = JobHandle_then(h2, doublefunc, &val);
+    assert(JobHandle_wait(h3) == 0);
+    assert(val == 40);
+    JobHandle_free(hg);
+    JobHandle_free(h1);
+    JobHandle_free(h2);
+    JobHandle_free(h3);
+
+    // Dependencies. While job 0 is held at the gate, job 2, which
+    // needs only job 1, finishes. Job 3 waits for jobs 0 and 1, and
+    // job 4 for jobs 2 and 3. Job 5 depends on a finished job and a
+    // NULL.
+    gate.running = gate.go = 0;
+    nlogged = 0;
+    JobHandle *dag[6];
+    dag[0] = JobQueue_submit(jq, gatefunc, &gate);
+    dag[1] = JobQueue_submit(jq, orderfunc, op + 1);
+    dag[2] = JobQueue_addJobAfter(jq, orderfunc, op + 2, dag + 1, 1);
+    JobHandle *pre3[] = { dag[0], dag[1] };
+    dag[3] = JobQueue_addJobAfter(jq, orderfunc, op + 3, pre3, 2);
+    dag[4] = JobQueue_addJobAfter(jq, orderfunc, op + 4, dag + 2, 2);
+    Gate_wait(&gate);
+    assert(JobHandle_wait(dag[2]) == 0);
+    assert(!JobHandle_poll(dag[3], NULL));
+    assert(nlogged == 2 && log[0] == 1 && log[1] == 2);
+    __atomic_store_n(&gate.go, 1, __ATOMIC_RELEASE);
+    assert(JobHandle_wait(dag[4]) == 0);
+    assert(nlogged == 4 && log[2] == 3 && log[3] == 4);
+    JobHandle *pre5[] = { dag[4], NULL };
+    dag[5] = JobQueue_addJobAfter(jq, orderfunc, op + 5, pre5, 2);
+    JobQueue_waitOnJobs(jq);
+    assert(nlogged == 5 && log[4] == 5);
+    for(i = 0; i < 6; ++i)
+        JobHandle_free(dag[i]);
+    JobQueue_free(jq);
+
+    // Error counts, with and without cancel-on-error. In each round,
+    // job 3 fails. Without cancellation, job 5 fails too.
+    for(int cancel = 0; cancel < 2; ++cancel) {
+        int ncalls = 0;
+        jq = JobQueue_new(1, &multiplier, ThreadState_new,
+                          ThreadState_free);
+        JobQueue_setOrder(jq, JOBQUEUE_FIFO);
+        JobQueue_setCancelOnError(jq, cancel);
+        JobQueue_setErrorCallback(jq, errfunc, &ncalls);
+        gate.running = gate.go = 0;
+        JobQueue_addJob(jq, gatefunc, &gate);
+        Gate_wait(&gate);
+        for(i = 0; i < njobs; ++i) {
+            codes[i] = (i == 3 ? 9 : i == 5 ? 11 : 0);
+            h[i] = JobQueue_submit(jq, statusfunc, codes + i);
+        }
+        __atomic_store_n(&gate.go, 1, __ATOMIC_RELEASE);
+        JobQueue_waitOnJobs(jq);
+        assert(JobQueue_firstError(jq) == 9);
+        if(cancel) {
+            assert(JobQueue_errorCount(jq) == 1);
+            assert(JobQueue_discardCount(jq) == njobs - 4);
+            assert(ncalls == 1);
+            assert(JobHandle_wait(h[4]) == ECANCELED);
+        } else {
+            assert(JobQueue_errorCount(jq) == 2);
+            assert(JobQueue_discardCount(jq) == 0);
+            assert(ncalls == 2);
+            assert(JobHandle_wait(h[5]) == 11);
+        }
+        for(i = 0; i < njobs; ++i)
+            JobHandle_free(h[i]);
+
+        // after clearing, jobs run again
+        JobQueue_clearErrors(jq);
+        assert(JobQueue_errorCount(jq) == 0);
+        assert(JobQueue_firstError(jq) == 0);
+        val = 1;
+        JobQueue_addJob(jq, doublefunc, &val);
+        JobQueue_waitOnJobs(jq);
+        assert(val == 2);
+        JobQueue_free(jq);
+    }
+
+    // Groups: waiting on one group does not wait for another group's
+    // job, which is held at the gate.
+    jq = JobQueue_new(nthreads, &multiplier, ThreadState_new,
+                      ThreadState_free);
+    JobGroup *ga = JobGroup_new(jq), *gb = JobGroup_new(jq);
+    gate.running = gate.go = 0;
+    JobGroup_add(ga, gatefunc, &gate);
+    Gate_wait(&gate);
+    for(i = 0; i < njobs; ++i) {
+        jobs[i].arg = i + 31.0;
+        jobs[i].result = -99.0;
+        JobGroup_add(gb, jobfunc, jobs + i);
+    }
+    assert(JobGroup_wait(gb) == 0);
+    for(i = 0; i < njobs; ++i)
+        assert(jobs[i].result == (i + 31.0) * multiplier);
+    assert(!__atomic_load_n(&gate.go, __ATOMIC_ACQUIRE));
+
+    // a group reports its own failures
+    codes[0] = 0;
+    codes[1] = 13;
+    JobGroup_add(gb, statusfunc, codes + 0);
+    JobGroup_add(gb, statusfunc, codes + 1);
+    assert(JobGroup_wait(gb) == 13);
+    assert(JobGroup_errorCount(gb) == 1);
+    assert(JobGroup_errorCount(ga) == 0);
+    JobGroup_free(gb);
+
+    __atomic_store_n(&gate.go, 1, __ATOMIC_RELEASE);
+    assert(JobGroup_wait(ga) == 0);
+    JobGroup_free(ga);
+    JobQueue_free(jq);
+
+    // Prespawn: every worker has built its state before any job
+    jq = JobQueue_new(nthreads, &multiplier, ThreadState_new,
+                      ThreadState_free);
+    __atomic_store_n(&nStates, 0, __ATOMIC_RELAXED);
+    JobQueue_prespawn(jq);
+    assert(__atomic_load_n(&nStates, __ATOMIC_RELAXED) == nthreads);
+    for(i = 0; i < njobs; ++i) {
+        jobs[i].arg = i + 41.0;
+        jobs[i].result = -99.0;
+    }
+    JobQueue_addJobs(jq, jobfunc, jobs, sizeof(jobs[0]), njobs);
+    JobQueue_waitOnJobs(jq);
+    for(i = 0; i < njobs; ++i)
+        assert(jobs[i].result == (i + 41.0) * multiplier);
+    assert(__atomic_load_n(&nStates, __ATOMIC_RELAXED) == nthreads);
+    __atomic_store_n(&nFreed, 0, __ATOMIC_RELAXED);
+    JobQueue_free(jq);
+
+    // JobQueue_free returns only after every worker has exited.
+    assert(__atomic_load_n(&nFreed, __ATOMIC_RELAXED) == nthreads);
+
+    // Many short-lived queues, as in nested analyses
+    for(int rep = 0; rep < 200; ++rep) {
+        __atomic_store_n(&nStates, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&nFreed, 0, __ATOMIC_RELAXED);
+        jq = JobQueue_new(nthreads, &multiplier, ThreadState_new,
+                          ThreadState_free);
+        JobQueue_addJobs(jq, jobfunc, jobs, sizeof(jobs[0]), njobs);
+        JobQueue_free(jq);
+        assert(__atomic_load_n(&nFreed, __ATOMIC_RELAXED)
+               == __atomic_load_n(&nStates, __ATOMIC_RELAXED));
+    }
+
+    // Elastic pool. A burst of blocked jobs grows the pool to its
+    // limit. Lowering the limit sheds busy workers once their jobs
+    // finish, and an idle timeout sheds idle ones down to the minimum.
+    __atomic_store_n(&nStates, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&nFreed, 0, __ATOMIC_RELAXED);
+    jq = JobQueue_new(4, &multiplier, ThreadState_new, ThreadState_free);
+    gate.running = gate.go = 0;
+    for(i = 0; i < 4; ++i)
+        JobQueue_addJob(jq, gatefunc, &gate);
+    assert(JobQueue_threadCount(jq) == 4);
+    JobQueue_setMaxThreads(jq, 2);
+    __atomic_store_n(&gate.go, 1, __ATOMIC_RELEASE);
+    JobQueue_waitOnJobs(jq);
+    assert(waitForThreads(jq, 2));
+    JobQueue_setMaxThreads(jq, 4);
+    JobQueue_setIdleTimeout(jq, 0.005, 1);
+    assert(waitForThreads(jq, 1));
+    assert(__atomic_load_n(&nFreed, __ATOMIC_RELAXED) == 3);
+    for(i = 0; i < njobs; ++i) {
+        jobs[i].arg = i + 7.0;
+        jobs[i].result = -99.0;
+    }
+    JobQueue_addJobs(jq, jobfunc, jobs, sizeof(jobs[0]), njobs);
+    JobQueue_waitOnJobs(jq);
+    for(i = 0; i < njobs; ++i)
+        assert(jobs[i].result == (i + 7.0) * multiplier);
+    JobQueue_free(jq);
+    assert(__atomic_load_n(&nFreed, __ATOMIC_RELAXED)
+           == __atomic_load_n(&nStates, __ATOMIC_RELAXED));
+
+    // Caller runs. While the only worker is held at the gate, the
+    // waiting caller runs the job that opens it, with a thread state
+    // of its own. Then, with an inline threshold of 2, the third
+    // job added behind the gate runs inside JobQueue_addJob.
+    __atomic_store_n(&nStates, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&nFreed, 0, __ATOMIC_RELAXED);
+    jq = JobQueue_new(1, &multiplier, ThreadState_new, ThreadState_free);
+    JobQueue_setCallerHelps(jq, true);
+    gate.running = gate.go = 0;
+    Opener opener = {.index = 99,.gate = &gate };
+    JobQueue_addJob(jq, gatefunc, &gate);
+    Gate_wait(&gate);
+    JobQueue_addJob(jq, openfunc, &opener);
+    JobQueue_waitOnJobs(jq);
+    assert(opener.index == -1);
+    assert(__atomic_load_n(&nStates, __ATOMIC_RELAXED) == 2);
+
+    JobQueue_setCallerHelps(jq, false);
+    JobQueue_setInlineThreshold(jq, 2);
+    Opener queued[2] = { {99, NULL}, {99, NULL} }, inl = { 99, NULL };
+    gate.running = gate.go = 0;
+    JobQueue_addJob(jq, gatefunc, &gate);
+    Gate_wait(&gate);
+    JobQueue_addJob(jq, openfunc, queued + 0);
+    JobQueue_addJob(jq, openfunc, queued + 1);
+    JobQueue_addJob(jq, openfunc, &inl);
+    assert(inl.index == -1);
+    assert(queued[0].index == 99 && queued[1].index == 99);
+    __atomic_store_n(&gate.go, 1, __ATOMIC_RELEASE);
+    JobQueue_waitOnJobs(jq);
+    assert(queued[0].index == 0 && queued[1].index == 0);
+    JobQueue_free(jq);
+    assert(__atomic_load_n(&nFreed, __ATOMIC_RELAXED) == 2);
+
+    // Spin-then-park: bursts of jobs, with and without spinning, so
+    // that workers are sometimes spinning and sometimes parked.
+    for(int spin = 0; spin < 2; ++spin) {
+        jq = JobQueue_new(nthreads, &multiplier, ThreadState_new,
+                          ThreadState_free);
+        JobQueue_setSpin(jq, spin ? 1e-3 : 0.0);
+        for(int burst = 0; burst < 50; ++burst) {
+            for(i = 0; i < njobs; ++i) {
+                jobs[i].arg = i + burst;
+                jobs[i].result = -99.0;
+                JobQueue_addJob(jq, jobfunc, jobs + i);
+            }
+            JobQueue_waitOnJobs(jq);
+            for(i = 0; i < njobs; ++i)
+                assert(jobs[i].result == (i + burst) * multiplier);
+            if(burst % 10 == 0)
+                sched_yield();
+        }
+        JobQueue_free(jq);
+    }
+
+    // Many producers at once, with and without work stealing
+    for(int steal = 0; steal < 2; ++steal) {
+        enum { NPROD = 4 };
+        pthread_t id[NPROD];
+        Producer prod[NPROD];
+        long count = 0;
+        jq = JobQueue_new(nthreads, &multiplier, ThreadState_new,
+                          ThreadState_free);
+        JobQueue_setWorkStealing(jq, steal);
+        for(i = 0; i < NPROD; ++i) {
+            prod[i].jq = jq;
+            prod[i].n = 5000;
+            prod[i].count = &count;
+            if(pthread_create(id + i, NULL, producerfun, prod + i)) {
+                fprintf(stderr, "%s:%d: pthread_create failed\n",
+                        __FILE__, __LINE__);
+                exit(1);
+            }
+        }
+        for(i = 0; i < NPROD; ++i)
+            pthread_join(id[i], NULL);
+        JobQueue_waitOnJobs(jq);
+        assert(__atomic_load_n(&count, __ATOMIC_RELAXED) == NPROD * 5000);
+        JobQueue_free(jq);
+    }
+
+    // Bounded queue. Behind the gate, the queue fills; then tries
+    // fail, and a producer blocks until the gate opens.
+    {
+        long count = 0;
+        pthread_t id;
+        Producer prod = {.n = 3,.count = &count };
+        jq = JobQueue_new(1, &multiplier, ThreadState_new,
+                          ThreadState_free);
+        JobQueue_setCapacity(jq, 4, 1);
+        prod.jq = jq;
+        gate.running = gate.go = 0;
+        JobQueue_addJob(jq, gatefunc, &gate);
+        Gate_wait(&gate);
+        for(i = 0; i < 4; ++i)
+            assert(JobQueue_tryAddJob(jq, countfunc, &count));
+        assert(!JobQueue_tryAddJob(jq, countfunc, &count));
+        assert(JobQueue_addJobTimed(jq, countfunc, &count, 0.005)
+               == ETIMEDOUT);
+        if(pthread_create(&id, NULL, producerfun, &prod)) {
+            fprintf(stderr, "%s:%d: pthread_create failed\n",
+                    __FILE__, __LINE__);
+            exit(1);
+        }
+        nanosleep(&pause, NULL);
+        JobQueue_queueLengths(jq, len);
+        for(i = 1; i < JOBQUEUE_NPRIORITY; ++i)
+            len[0] += len[i];
+        assert(len[0] == 4);
+        __atomic_store_n(&gate.go, 1, __ATOMIC_RELEASE);
+        pthread_join(id, NULL);
+        JobQueue_waitOnJobs(jq);
+        assert(__atomic_load_n(&count, __ATOMIC_RELAXED) == 7);
+        JobQueue_free(jq);
+    }
+
+    // A worker's timed add to its own full queue runs the job.
+    {
+        jq = JobQueue_new(1, NULL, NULL, NULL);
+        JobQueue_setCapacity(jq, 1, 0);
+        Timed t = {.jq = jq,.count = 0 };
+        JobQueue_addJob(jq, timedfunc, &t);
+        JobQueue_waitOnJobs(jq);
+        assert(t.status == 0);
+        assert(t.ranHere);
+        assert(t.count == 2);
+        JobQueue_free(jq);
+    }
+
+    // A submitter blocked on a full queue fails, as a late one would,
+    // once the queue stops accepting jobs. Failing means exiting, so
+    // this runs in a child process.
+    {
+        int wstatus;
+        pid_t pid = fork();
+        assert(pid >= 0);
+        if(pid == 0) {
+            long count = 0;
+            pthread_t id;
+            Producer prod = {.n = 1,.count = &count };
+            if(freopen("/dev/null", "w", stderr) == NULL)
+                _exit(2);
+            jq = JobQueue_new(1, NULL, NULL, NULL);
+            JobQueue_setCapacity(jq, 1, 0);
+            prod.jq = jq;
+            gate.running = gate.go = 0;
+            JobQueue_addJob(jq, gatefunc, &gate);
+            Gate_wait(&gate);
+            JobQueue_addJob(jq, countfunc, &count);
+            if(pthread_create(&id, NULL, producerfun, &prod))
+                _exit(2);
+            nanosleep(&pause, NULL);
+            JobQueue_noMoreJobs(jq);
+            pthread_join(id, NULL);
+            _exit(0);
+        }
+        assert(waitpid(pid, &wstatus, 0) == pid);
+        assert(WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == 1);
+    }
+
+    // Many producers against a small bound
+    {
+        enum { NPROD = 4 };
+        pthread_t id[NPROD];
+        Producer prod[NPROD];
+        JobStats total;
+        long count = 0;
+        jq = JobQueue_new(nthreads, &multiplier, ThreadState_new,
+                          ThreadState_free);
+        JobQueue_setCapacity(jq, 64, 16);
+        JobQueue_setTiming(jq, true);
+        for(i = 0; i < NPROD; ++i) {
+            prod[i].jq = jq;
+            prod[i].n = 5000;
+            prod[i].count = &count;
+            if(pthread_create(id + i, NULL, producerfun, prod + i)) {
+                fprintf(stderr, "%s:%d: pthread_create failed\n",
+                        __FILE__, __LINE__);
+                exit(1);
+            }
+        }
+        for(i = 0; i < NPROD; ++i)
+            pthread_join(id[i], NULL);
+        JobQueue_waitOnJobs(jq);
+        assert(__atomic_load_n(&count, __ATOMIC_RELAXED) == NPROD * 5000);
+        JobQueue_getStats(jq, &total, NULL);
+        assert(total.maxQueued <= 64 + NPROD);
+        JobQueue_free(jq);
+    }
+
+    // A batch much larger than the bound goes in bounded chunks, and
+    // jobs added to a group wait for room too.
+    {
+        long count = 0;
+        JobStats total;
+        jq = JobQueue_new(nthreads, NULL, NULL, NULL);
+        JobQueue_setCapacity(jq, 64, 16);
+        JobQueue_setTiming(jq, true);
+        JobQueue_addJobs(jq, countfunc, &count, 0, 10000);
+        JobQueue_waitOnJobs(jq);
+        assert(__atomic_load_n(&count, __ATOMIC_RELAXED) == 10000);
+        JobGroup *g = JobGroup_new(jq);
+        for(i = 0; i < 10000; ++i)
+            JobGroup_add(g, countfunc, &count);
+        assert(JobGroup_wait(g) == 0);
+        JobGroup_free(g);
+        assert(__atomic_load_n(&count, __ATOMIC_RELAXED) == 20000);
+        JobQueue_getStats(jq, &total, NULL);
+        assert(total.maxQueued <= 64);
+        JobQueue_free(jq);
+    }
+
+    // Cancellation. Behind the gate, cancel a token carried by five
+    // queued jobs: only the other two run. A job that expires in the
+    // queue is skipped, a running job sees its token cancelled, and
+    // a job's children inherit its token.
+    {
+        long count = 0;
+        int flag = 0;
+        CancelToken *tok = CancelToken_new();
+        jq = JobQueue_new(1, &multiplier, ThreadState_new,
+                          ThreadState_free);
+        gate.running = gate.go = 0;
+        JobQueue_addJob(jq, gatefunc, &gate);
+        Gate_wait(&gate);
+        for(i = 0; i < 5; ++i)
+            JobQueue_addJobCancelable(jq, countfunc, &count, tok, 0.0);
+        JobHandle *hc = JobQueue_submit(jq, countfunc, &count);
+        JobQueue_addJobCancelable(jq, countfunc, &count, NULL, 0.0);
+        JobQueue_addJobCancelable(jq, countfunc, &count, NULL, 0.001);
+        CancelToken_cancel(tok);
+        assert(CancelToken_cancelled(tok));
+        nanosleep(&pause, NULL);
+        __atomic_store_n(&gate.go, 1, __ATOMIC_RELEASE);
+        JobQueue_waitOnJobs(jq);
+        assert(JobHandle_wait(hc) == 0);
+        JobHandle_free(hc);
+        assert(count == 2);
+        assert(JobQueue_discardCount(jq) == 6);
+        CancelToken_free(tok);
+
+        tok = CancelToken_new();
+        JobQueue_addJobCancelable(jq, pollfunc, &flag, tok, 0.0);
+        while(__atomic_load_n(&flag, __ATOMIC_ACQUIRE) != 1)
+            sched_yield();
+        CancelToken_cancel(tok);
+        JobQueue_waitOnJobs(jq);
+        assert(flag == 2);
+        assert(!JobQueue_jobCancelled());
+        CancelToken_free(tok);
+
+        count = 0;
+        tok = CancelToken_new();
+        Spawner sp = {.jq = jq,.token = tok,.count = &count };
+        JobQueue_addJobCancelable(jq, spawnfunc, &sp, tok, 0.0);
+        CancelToken_free(tok);
+        JobQueue_waitOnJobs(jq);
+        assert(count == 0);
+        assert(JobQueue_discardCount(jq) == 7);
+        JobQueue_free(jq);
+    }
+
+    // Nested parallelism: jobs that wait for the jobs they submit,
+    // on pools smaller than the recursion is deep, with and without
+    // work stealing.
+    for(int nt = 1; nt <= 3; nt += 2) {
+        jq = JobQueue_new(nt, NULL, NULL, NULL);
+        JobQueue_setWorkStealing(jq, nt > 1);
+        for(int mode = 0; mode < 2; ++mode) {
+            Split sp = {.jq = jq,.group = mode,.lo = 0,.hi = 1000 };
+            JobQueue_addJob(jq, splitfunc, &sp);
+            JobQueue_waitOnJobs(jq);
+            assert(sp.sum == 999 * 1000 / 2);
+        }
+        Split sp = {.jq = jq,.lo = 0,.hi = 1000 };
+        JobQueue_addJob(jq, waitfunc, &sp);
+        JobQueue_waitOnJobs(jq);
+        assert(sp.sum == 999 * 1000 / 2);
+        JobQueue_free(jq);
+    }
+
+    // Several jobs waiting on the queue at once. A waiter that is
+    // running a child of another's job must not let that other
+    // waiter return early.
+    for(int nt = 1; nt <= 2; ++nt) {
+        Outer outer[2];
+        jq = JobQueue_new(nt, NULL, NULL, NULL);
+        JobQueue_setWorkStealing(jq, nt > 1);
+        for(i = 0; i < 2; ++i) {
+            outer[i] = (Outer) {.jq = jq,.done = 0,.seen = 0 };
+            JobQueue_addJob(jq, outerfunc, outer + i);
+        }
+        JobQueue_waitOnJobs(jq);
+        for(i = 0; i < 2; ++i)
+            assert(outer[i].seen == 5);
+        JobQueue_free(jq);
+    }
+
+    // Deterministic mode: job i runs on worker i % 3, in order, so
+    // each draws the same number in every run, whether added one at
+    // a time or in bulk.
+    {
+        enum { NDRAW = 60 };
+        Draw draws[2][2 * NDRAW];
+        for(int run = 0; run < 2; ++run) {
+            Draw *d = draws[run];
+            jq = JobQueue_new(3, NULL, Rng_new, free);
+            JobQueue_setDeterministic(jq, true);
+            for(i = 0; i < NDRAW; ++i)
+                JobQueue_addJob(jq, drawfunc, d + i);
+            JobQueue_addJobs(jq, drawfunc, d + NDRAW, sizeof(Draw), NDRAW);
+            JobQueue_waitOnJobs(jq);
+            JobQueue_free(jq);
+        }
+        for(i = 0; i < 2 * NDRAW; ++i) {
+            assert(draws[0][i].worker == i % 3);
+            assert(draws[0][i].worker == draws[1][i].worker);
+            assert(draws[0][i].draw == draws[1][i].draw);
+        }
+    }
+
+    // Completion through a descriptor: each job is reported once,
+    // with its status, and the descriptor is quiet once a call finds
+    // nothing left.
+    jq = JobQueue_new(nthreads, NULL, NULL, NULL);
+    {
+        enum { NDONE = 100 };
+        int rc[NDONE], seen[NDONE] = { 0 }, ndone = 0;
+        JobCompletion done[7];
+        struct pollfd pfd = {.fd = JobQueue_completionFd(jq),.events =
+                POLLIN };
+        assert(pfd.fd == JobQueue_completionFd(jq));
+        for(i = 0; i < NDONE; ++i) {
+            rc[i] = (i % 10 == 0 ? 3 : 0);
+            JobQueue_addJob(jq, statusfunc, rc + i);
+        }
+        while(ndone < NDONE) {
+            assert(poll(&pfd, 1, 10000) == 1);
+            int n = JobQueue_completions(jq, done, 7);
+            for(int k = 0; k < n; ++k) {
+                int *code = (int *) done[k].param;
+                assert(done[k].status == *code);
+                ++seen[code - rc];
+            }
+            ndone += n;
+        }
+        for(i = 0; i < NDONE; ++i)
+            assert(seen[i] == 1);
+        assert(JobQueue_completions(jq, done, 7) == 0);
+        assert(poll(&pfd, 1, 0) == 0);
+        JobQueue_clearErrors(jq);
+    }
+    JobQueue_free(jq);
+
+    // Shared pool. With one thread, the two queues never have more
+    // than one worker between them, so their jobs never overlap, and
+    // while both queues have a backlog, the one of weight 3 gets more
+    // turns. An idle worker makes way for the other queue, and a job
+    // may wait on the other queue.
+    {
+        enum { NMEMBER = 60 };
+        JobPool *pool = JobPool_new(1);
+        JobQueue *qa = JobQueue_new(2, NULL, NULL, NULL);
+        JobQueue *qb = JobQueue_new(2, NULL, NULL, NULL);
+        JobQueue_setPool(qa, pool, 3);
+        JobQueue_setPool(qb, pool, 1);
+        int tags[2 * NMEMBER], nlog = 0, live = 0, maxLive = 0, na = 0;
+        Member m[2] = {
+            {0, tags, &nlog, &live, &maxLive},
+            {1, tags, &nlog, &live, &maxLive}
+        };
+        gate.running = gate.go = 0;
+        JobQueue_addJob(qa, gatefunc, &gate);
+        Gate_wait(&gate);
+        for(i = 0; i < NMEMBER; ++i) {
+            JobQueue_addJob(qa, memberfunc, m + 0);
+            JobQueue_addJob(qb, memberfunc, m + 1);
+        }
+        __atomic_store_n(&gate.go, 1, __ATOMIC_RELEASE);
+        while(__atomic_load_n(&nlog, __ATOMIC_RELAXED) < 2 * NMEMBER) {
+            assert(JobQueue_threadCount(qa) + JobQueue_threadCount(qb)
+                   <= 1);
+            sched_yield();
+        }
+        JobQueue_waitOnJobs(qa);
+        JobQueue_waitOnJobs(qb);
+        assert(nlog == 2 * NMEMBER);
+        assert(maxLive == 1);
+        for(i = 0; i < NMEMBER; ++i)
+            na += (tags[i] == 0);
+        assert(na > NMEMBER / 2);
+
+        // One queue's worker is left idle, holding the thread, and
+        // gives it up when the other queue needs it.
+        for(i = 0; i < 2; ++i) {
+            JobQueue *q = (i == 0 ? qa : qb);
+            int y = 5;
+            JobQueue_addJob(q, doublefunc, &y);
+            JobQueue_waitOnJobs(q);
+            assert(y == 10);
+            assert(JobQueue_threadCount(qa) + JobQueue_threadCount(qb)
+                   <= 1);
+        }
+
+        // qa's worker, waiting, runs qb's job, and waitOnJobs on qb
+        // waits for it.
+        Cross c = {.other = qb,.x = 21,.submitted = 0 };
+        JobQueue_addJob(qa, crossfunc, &c);
+        while(!__atomic_load_n(&c.submitted, __ATOMIC_ACQUIRE))
+            sched_yield();
+        JobQueue_waitOnJobs(qb);
+        assert(c.x == 42);
+        JobQueue_waitOnJobs(qa);
+        JobQueue_free(qa);
+        JobQueue_free(qb);
+        JobPool_free(pool);
+    }
+
+    // Parameters copied into the job outlive the caller's copy.
+    jq = JobQueue_new(nthreads, NULL, NULL, NULL);
+    {
+        long sum = 0, expect = 0;
+        Copied c = {.sum = &sum };
+        size_t nv = sizeof(c.v) / sizeof(c.v[0]);
+        for(i = 0; i < 1000; ++i) {
+            for(size_t k = 0; k < nv; ++k) {
+                c.v[k] = i + k;
+                expect += i + k;
+            }
+            JobQueue_addJobCopy(jq, copyfunc, &c, sizeof(c));
+        }
+        memset(&c, 0, sizeof(c));
+        JobQueue_waitOnJobs(jq);
+        assert(sum == expect);
+    }
+    JobQueue_free(jq);
+
+    // Scratch arenas. Each job gets the arena back where the last
+    // one started, and a job that outgrows it spills to the heap.
+    assert(JobQueue_scratch(8) == NULL);
+    jq = JobQueue_new(1, NULL, NULL, NULL);
+    JobQueue_setArenaSize(jq, 1024);
+    {
+        Scratch sc[3] = { {100, 3, NULL}, {24, 1, NULL}, {600, 4, NULL} };
+        for(i = 0; i < 3; ++i) {
+            JobQueue_addJob(jq, scratchfunc, sc + i);
+            JobQueue_waitOnJobs(jq);
+        }
+        assert(sc[0].first == sc[1].first);
+        assert(sc[1].first == sc[2].first);
+    }
+    JobQueue_free(jq);
+
+    // Statistics
+    {
+        JobStats total, perWorker[nthreads];
+        long nrun = 0, nwait = 0, sum = 0;
+        jq = JobQueue_new(nthreads, &multiplier, ThreadState_new,
+                          ThreadState_free);
+        JobQueue_setTiming(jq, true);
+        for(i = 0; i < njobs; ++i)
+            JobQueue_addJob(jq, jobfunc, jobs + i);
+        JobQueue_addJobs(jq, jobfunc, jobs, sizeof(jobs[0]), njobs);
+        JobQueue_waitOnJobs(jq);
+        JobQueue_getStats(jq, &total, perWorker);
+        assert(total.jobsRun == 2 * njobs);
+        assert(total.queued == 0);
+        assert(total.maxQueued >= 1 && total.maxQueued <= 2 * njobs);
+        for(i = 0; i < JOBQUEUE_HIST_BINS; ++i) {
+            nrun += total.runHist[i];
+            nwait += total.waitHist[i];
+        }
+        assert(nrun == total.jobsRun);
+        assert(nwait == total.jobsRun);
+        for(i = 0; i < nthreads; ++i)
+            sum += perWorker[i].jobsRun;
+        assert(sum == total.jobsRun);
+        assert(total.runSeconds >= 0.0 && total.idleSeconds >= 0.0);
+
+        // counts are kept with timing off, but times are not
+        JobQueue_setTiming(jq, false);
+        JobQueue_addJobs(jq, jobfunc, jobs, sizeof(jobs[0]), njobs);
+        JobQueue_waitOnJobs(jq);
+        double runSeconds = total.runSeconds;
+        JobQueue_getStats(jq, &total, NULL);
+        assert(total.jobsRun == 3 * njobs);
+        assert(total.runSeconds == runSeconds);
+        JobQueue_free(jq);
+        if(verbose)
+            printf("stats OK\n");
+    }
+
+    // Tracing
+    {
+        char line[256];
+        int nstart = 0, nfinish = 0, nenqueue = 0;
+        jq = JobQueue_new(nthreads, &multiplier, ThreadState_new,
+                          ThreadState_free);
+        JobQueue_addJob(jq, jobfunc, jobs);  // not traced
+        JobQueue_waitOnJobs(jq);
+        JobQueue_setTracing(jq, true);
+        for(i = 0; i < njobs; ++i)
+            JobQueue_addJob(jq, jobfunc, jobs + i);
+        JobQueue_addJobs(jq, jobfunc, jobs, sizeof(jobs[0]), njobs);
+        JobQueue_waitOnJobs(jq);
+        JobQueue_setTracing(jq, false);
+        JobQueue_addJob(jq, jobfunc, jobs);  // not traced
+        JobQueue_waitOnJobs(jq);
+
+        FILE *fp = tmpfile();
+        assert(fp);
+        JobQueue_writeTrace(jq, fp);
+        rewind(fp);
+        while(fgets(line, sizeof line, fp)) {
+            if(strstr(line, "\"name\":\"job\",\"ph\":\"B\""))
+                ++nstart;
+            if(strstr(line, "\"name\":\"job\",\"ph\":\"E\""))
+                ++nfinish;
+            if(strstr(line, "\"name\":\"enqueue\""))
+                ++nenqueue;
+        }
+        fclose(fp);
+        assert(nenqueue == 2 * njobs);
+        assert(nstart == 2 * njobs);
+        assert(nfinish == 2 * njobs);
+        if(verbose)
+            JobQueue_writeTrace(jq, stdout);
+        JobQueue_free(jq);
+    }
+
+    // CPU affinity
+    {
+        Place place[njobs];
+        int cpu0 = 0;
+
+        assert(JobQueue_workerIndex() == -1);
+        assert(JobQueue_workerNode() == -1);
+
+        jq = JobQueue_new(nthreads, NULL, PinState_new, free);
+        JobQueue_setCpuList(jq, 1, &cpu0);
+        JobQueue_addJobs(jq, placefunc, place, sizeof(place[0]), njobs);
+        JobQueue_waitOnJobs(jq);
+        for(i = 0; i < njobs; ++i) {
+            assert(place[i].index >= 0 && place[i].index < nthreads);
+            assert(place[i].node >= 0);
+            assert(place[i].cpu == 0);
+            assert(place[i].initCpu == 0);
+        }
+        JobQueue_free(jq);
+
+        for(int policy = JOBQUEUE_COMPACT; policy <= JOBQUEUE_SPREAD;
+            ++policy) {
+            jq = JobQueue_new(nthreads, NULL, PinState_new, free);
+            JobQueue_setAffinity(jq, (JobAffinity) policy);
+            JobQueue_addJobs(jq, placefunc, place, sizeof(place[0]),
+                             njobs);
+            JobQueue_waitOnJobs(jq);
+            for(i = 0; i < njobs; ++i) {
+                assert(place[i].node >= 0);
+                assert(place[i].cpu == place[i].initCpu);
+            }
+            JobQueue_free(jq);
+        }
+
+        // unpinned workers report no node
+        jq = JobQueue_new(nthreads, NULL, PinState_new, free);
+        JobQueue_setAffinity(jq, JOBQUEUE_COMPACT);
+        JobQueue_setAffinity(jq, JOBQUEUE_UNPINNED);
+        JobQueue_addJobs(jq, placefunc, place, sizeof(place[0]), njobs);
+        JobQueue_waitOnJobs(jq);
+        for(i = 0; i < njobs; ++i) {
+            assert(place[i].index >= 0 && place[i].index < nthreads);
+            assert(place[i].node == -1);
+        }
+        JobQueue_free(jq);
+        if(verbose)
+            printf("affinity OK\n");
+    }
+
     unitTstResult("JobQueue", "OK");
     return 0;
 }
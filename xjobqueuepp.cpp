@@ -0,0 +1,186 @@
+/**
+ * @file xjobqueuepp.cpp
+ * @author Alan R. Rogers
+ * @brief Test jobqueue.hpp.
+ * @copyright Copyright (c) 2014, Alan R. Rogers
+ * <rogers@anthro.utah.edu>. This file is released under the Internet
+ * Systems Consortium License, which can be found in file "LICENSE".
+ */
+
+#include "jobqueue.hpp"
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <vector>
+#include <assert.h>
+#include <sched.h>
+
+#ifdef NDEBUG
+#error "Unit tests must be compiled without -DNDEBUG flag"
+#endif
+
+static void unitTstResult(const char *facility, const char *result);
+
+/// Counts live copies, to check that every stored callable is
+/// destroyed exactly once.
+struct Counted {
+    static std::atomic<int> live;
+    Counted() {
+        ++live;
+    }
+    Counted(const Counted &) {
+        ++live;
+    }
+    Counted(Counted &&) noexcept {
+        ++live;
+    }
+    ~Counted() {
+        --live;
+    }
+};
+std::atomic<int> Counted::live(0);
+
+/// Per-worker state
+struct Tally {
+    int multiplier;
+    long jobs;                  // jobs run by this worker
+};
+
+/// Holds a job until go is set
+struct Gate {
+    std::atomic<int> running, go;
+};
+
+static void unitTstResult(const char *facility, const char *result) {
+    printf("%-26s %s\n", facility, result);
+}
+
+int main(int argc, char **argv) {
+    int verbose = 0;
+
+    switch (argc) {
+    case 1:
+        break;
+    case 2:
+        if(strncmp(argv[1], "-v", 2) != 0) {
+            fprintf(stderr, "usage: xjobqueuepp [-v]\n");
+            exit(1);
+        }
+        verbose = 1;
+        break;
+    default:
+        fprintf(stderr, "usage: xjobqueuepp [-v]\n");
+        exit(1);
+    }
+
+    const int nthreads = 3;
+
+    // Small, trivially copyable lambdas are copied into the node.
+    {
+        jobqueue::Queue<> q(nthreads);
+        std::atomic<long> sum(0);
+        for(long i = 1; i <= 100; ++i)
+            q.add([&sum, i] { sum += i; });
+        q.wait();
+        assert(sum == 5050);
+        if(verbose)
+            printf("copied lambdas OK\n");
+    }
+
+    // Move-only captures are moved into the node and destroyed once
+    // they have run. So are captures too big for the node, which go
+    // on the heap.
+    {
+        jobqueue::Queue<> q(nthreads);
+        std::atomic<long> sum(0);
+        for(int i = 1; i <= 100; ++i) {
+            std::unique_ptr<int> p(new int(i));
+            q.add([&sum, p = std::move(p), c = Counted()] { sum += *p; });
+        }
+        std::array<long, 16> big;
+        for(int i = 0; i < 16; ++i)
+            big[i] = i;
+        for(int i = 0; i < 10; ++i)
+            q.add([&sum, big, c = Counted()] {
+                  for(long x : big) sum += x;});
+        q.wait();
+        assert(sum == 5050 + 10 * 120);
+        assert(Counted::live == 0);
+        if(verbose)
+            printf("moved lambdas OK\n");
+    }
+
+    // Jobs discarded unrun still destroy their callables, and int
+    // results are job statuses.
+    {
+        jobqueue::Queue<> q(1);
+        JobQueue_setOrder(q.get(), JOBQUEUE_FIFO);
+        JobQueue_setCancelOnError(q.get(), true);
+        Gate gate;
+        gate.running = gate.go = 0;
+        std::atomic<int> ran(0);
+        q.add([&gate] {
+              gate.running = 1;
+              while(!gate.go)
+                  sched_yield();
+              return EINVAL;});
+        while(!gate.running)
+            sched_yield();
+        for(int i = 0; i < 20; ++i)
+            q.add([&ran, c = Counted()] { ++ran; });
+        gate.go = 1;
+        q.wait();
+        assert(q.firstError() == EINVAL);
+        assert(ran + JobQueue_discardCount(q.get()) == 20);
+        assert(Counted::live == 0);
+        if(verbose)
+            printf("discarded lambdas OK\n");
+    }
+
+    // Typed thread state, and the loops.
+    {
+        jobqueue::Queue<Tally> q(nthreads, Tally{ 3, 0 });
+        std::atomic<long> sum(0);
+        for(long i = 1; i <= 100; ++i)
+            q.add([&sum, i] (Tally & t) {
+                  sum += t.multiplier * i;
+                  ++t.jobs;});
+        q.wait();
+        assert(sum == 3 * 5050);
+
+        const long n = 10000;
+        std::vector<long> v(n, 0);
+        int status = q.parallelFor(0, n, [&v] (long i, Tally & t) {
+                                   v[i] = t.multiplier * i;});
+        assert(status == 0);
+        for(long i = 0; i < n; ++i)
+            assert(v[i] == 3 * i);
+
+        sum = 0;
+        status = q.parallelForRange(0, n, [&sum, &v] (long lo, long hi) {
+                                    long s = 0;
+                                    for(long i = lo; i < hi; ++i)
+                                        s += v[i];
+                                    sum += s;}, 100);
+        assert(status == 0);
+        assert(sum == 3 * n * (n - 1) / 2);
+
+        status = q.forEach(v.data(), n, [] (long &x) { x = -x; });
+        assert(status == 0);
+        for(long i = 0; i < n; ++i)
+            assert(v[i] == -3 * i);
+
+        status = q.parallelFor(0, n, [] (long i) {
+                               return i == n / 2 ? ERANGE : 0;});
+        assert(status == ERANGE);
+        if(verbose)
+            printf("thread state and loops OK\n");
+    }
+
+    unitTstResult("jobqueue.hpp", "OK");
+    return 0;
+}